@@ -18,20 +18,6 @@
 */
 #include "HeatPump.h"
 
-String getHEXformatted(uint8_t *bytes, size_t len)
-{
-  String res;
-  char buf[5];
-  for (size_t i = 0; i < len; i++)
-  {
-    if (i > 0)
-      res += ':';
-    sprintf(buf, "%02X", bytes[i]);
-    res += buf;
-  }
-  return res;
-}
-
 // Structures //////////////////////////////////////////////////////////////////
 
 bool operator==(const heatpumpSettings &lhs, const heatpumpSettings &rhs)
@@ -85,13 +71,114 @@ bool operator!=(const heatpumpTimers &lhs, const heatpumpTimers &rhs)
          lhs.offMinutesRemaining != rhs.offMinutesRemaining;
 }
 
+// Shared tables ////////////////////////////////////////////////////////////////
+
+// packet templates, only ever copied into a packet
+static const byte CONNECT[] PROGMEM = {0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01, 0xa8};
+static const byte HEADER[] PROGMEM = {0xfc, 0x41, 0x01, 0x30, 0x10, 0x01, 0x00, 0x00};
+static const byte INFOHEADER[] PROGMEM = {0xfc, 0x42, 0x01, 0x30, 0x10};
+
+static constexpr byte CONTROL_PACKET_1[5] = {0x01,    0x02,  0x04,  0x08, 0x10};
+                                          //{"POWER","MODE","TEMP","FAN","VANE"};
+static constexpr byte CONTROL_PACKET_2[1] = {0x01};
+                                          //{"WIDEVANE"};
+
+const HeatPump::PollSlotConfig HeatPump::INFOMODE[INFOMODE_LEN] = {
+  {0x02, 4, 1000, 10000},  // request a settings packet - RQST_PKT_SETTINGS
+  {0x03, 2, 2000, 30000},  // request the current room temp - RQST_PKT_ROOM_TEMP
+  // 0x04, // unknown
+  {0x05, 1, 5000, 120000}, // request the timers - RQST_PKT_TIMERS
+  {0x06, 3, 1000, 30000},  // request status - RQST_PKT_STATUS
+  // 0x09, // request standby mode (maybe?) RQST_PKT_STANDBY
+  // 0x20, //	Unknown 
+  // 0x22 //	Unknown 
+};
+
+const char* const HeatPump::TIMER_MODE_MAP[TIMER_MODE_LEN] = {"NONE", "OFF", "ON", "BOTH"};
+
+const uint16_t HeatPump::LATENCY_BUCKET_MS[LATENCY_BUCKETS] = {50, 100, 150, 200, 300, 500, 1000, 0};
+const byte HeatPump::REGISTER_COMMANDS[REGISTER_COUNT] = {0x02, 0x03, 0x04, 0x05, 0x06, 0x09};
+
+static unsigned long clampMs(unsigned long value, unsigned long low, unsigned long high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
+
+// info requests sent once by the capability probe, 0x22 is answered whenever 0x20 is
+static const byte PROBE_COMMANDS[] PROGMEM = {0x02, 0x03, 0x05, 0x06, 0x09, 0x20};
+static const int PROBE_COMMANDS_LEN = sizeof(PROBE_COMMANDS);
+
+// typed settings, indexed by the enumerator value
+static constexpr byte POWER_BYTES[]            = {0x00, 0x01};
+static constexpr const char* POWER_NAMES[]     = {"OFF", "ON"};
+static constexpr byte MODE_BYTES[]             = {0x01,   0x02,  0x03,   0x07,  0x08};
+static constexpr const char* MODE_NAMES[]      = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
+static constexpr byte FAN_BYTES[]              = {0x00,   0x01,    0x02, 0x03, 0x05, 0x06};
+static constexpr const char* FAN_NAMES[]       = {"AUTO", "QUIET", "1",  "2",  "3",  "4"};
+static constexpr byte VANE_BYTES[]             = {0x00,   0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
+static constexpr const char* VANE_NAMES[]      = {"AUTO", "1",  "2",  "3",  "4",  "5",  "SWING"};
+static constexpr byte WIDEVANE_BYTES[]         = {0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x0c};
+static constexpr const char* WIDEVANE_NAMES[]  = {"<<", "<",  "|",  ">",  ">>", "<>", "SWING"};
+
+static_assert(sizeof(POWER_BYTES) == (int)HeatPump::Power::On + 1, "POWER_BYTES does not match HeatPump::Power");
+static_assert(sizeof(MODE_BYTES) == (int)HeatPump::Mode::Auto + 1, "MODE_BYTES does not match HeatPump::Mode");
+static_assert(sizeof(FAN_BYTES) == (int)HeatPump::Fan::Speed4 + 1, "FAN_BYTES does not match HeatPump::Fan");
+static_assert(sizeof(VANE_BYTES) == (int)HeatPump::Vane::Swing + 1, "VANE_BYTES does not match HeatPump::Vane");
+static_assert(sizeof(WIDEVANE_BYTES) == (int)HeatPump::WideVane::Swing + 1, "WIDEVANE_BYTES does not match HeatPump::WideVane");
+
+// target temperature limits in half degrees
+static constexpr uint8_t TEMP_HALF_DEG_MIN       = 10 * 2; // with the 0.5 degree encoding (tempMode)
+static constexpr uint8_t TEMP_HALF_DEG_INDEX_MIN = 16 * 2; // with the whole degree index encoding
+static constexpr uint8_t TEMP_HALF_DEG_MAX       = 31 * 2;
+
+// unknown bytes decode to the first entry, like lookupByteMapValue()
+template <typename T, int N>
+static T enumFromByte(const byte (&bytes)[N], byte value)
+{
+  for (int i = 0; i < N; i++)
+  {
+    if (bytes[i] == value)
+    {
+      return (T)i;
+    }
+  }
+  return (T)0;
+}
+
+template <typename T, int N>
+static bool enumFromName(const char* const (&names)[N], const char *name, T &value)
+{
+  if (name == NULL)
+  {
+    return false;
+  }
+  for (int i = 0; i < N; i++)
+  {
+    if (strcasecmp(names[i], name) == 0)
+    {
+      value = (T)i;
+      return true;
+    }
+  }
+  return false;
+}
+
 // Constructor /////////////////////////////////////////////////////////////////
 
 HeatPump::HeatPump()
 {
+  static_assert(sizeof(CONNECT) == CONNECT_LEN && sizeof(HEADER) == HEADER_LEN && sizeof(INFOHEADER) == INFOHEADER_LEN,
+                "packet template length mismatch");
   lastSend = 0;
+  lastReply = 0;
   lastSendUpdate = 0;
-  infoMode = 0;
+  for (int i = 0; i < INFOMODE_LEN; i++)
+  {
+    pollState[i].lastPolled = 0;
+    pollState[i].targetMs = min(INFOMODE[i].minIntervalMs * 4, INFOMODE[i].maxIntervalMs);
+    pollState[i].boostUntil = 0;
+    pollState[i].due = true; // everything is unknown until the first reply
+  }
   lastRecv = millis() - (PACKET_SENT_INTERVAL_MS * 60);
   autoUpdate = false;
   firstRun = true;
@@ -100,6 +187,7 @@ HeatPump::HeatPump()
   externalUpdate = false;
   wideVaneAdj = false;
   functions = heatpumpFunctions();
+  eventMask = EVENT_ALL;
 }
 
 // Public Methods //////////////////////////////////////////////////////////////
@@ -108,37 +196,12 @@ HeatPump::HeatPump()
 
 bool HeatPump::connect(Uart *serial, int bitrate)
 {
-
   if (serial != NULL)
   {
-    _HardSerial = serial;
-  }
-  _HardSerial->begin(bitrate, SERIAL_8E1);
-  _HardSerial->setTimeout(PACKET_RESPONSE_WAIT_TIME);
-
-  pinPeripheral(10, PIO_SERCOM);
-  pinPeripheral(11, PIO_SERCOM);
-
-  if (onConnectCallback)
-  {
-    onConnectCallback();
-  }
-
-  // settle before we start sending packets
-  delay(2000);
-
-  // send the CONNECT packet twice - need to copy the CONNECT packet locally
-  byte packet[CONNECT_LEN];
-  memcpy(packet, CONNECT, CONNECT_LEN);
-
-  writePacket(packet, CONNECT_LEN); //Send connect command
-  int packetType = readPacket(true);  //Read response packet (blocking)
-  
-  if (packetType != RCVD_PKT_CONNECT_SUCCESS && bitrate == 2400)
-  {
-    return connect(serial, 9600);
+    serialTransport.setSerial(serial);
   }
-  return packetType == RCVD_PKT_CONNECT_SUCCESS;
+  transport = &serialTransport;
+  return startConnect(bitrate == 2400 ? 0 : bitrate); // 2400 is the default, fall back to 9600 as before
 }
 
 #else
@@ -162,356 +225,1080 @@ bool HeatPump::connect(HardwareSerial *serial, int bitrate, int rx, int tx)
 {
   if (serial != NULL)
   {
-    _HardSerial = serial;
-  }
-  bool retry = false;
-  if (bitrate == 0)
-  {
-    bitrate = 2400;
-    retry = true;
+    serialTransport.setSerial(serial);
   }
-  connected = false;
-  Serial.printf("Connecting at baud rate %d\n", bitrate);
   if (rx >= 0 && tx >= 0)
   {
-    #if defined(ESP32)
-    _HardSerial->begin(bitrate, SERIAL_8E1, rx, tx);
-    #else
-    _HardSerial->begin(bitrate, SERIAL_8E1);
-    #endif
+    serialTransport.setPins(rx, tx);
   }
-  else
+  transport = &serialTransport;
+  return startConnect(bitrate);
+}
+
+#endif
+
+bool HeatPump::connect(HeatPumpTransport *transport, int bitrate)
+{
+  if (transport != nullptr)
   {
-    _HardSerial->begin(bitrate, SERIAL_8E1);
+    this->transport = transport;
   }
+  return startConnect(bitrate);
+}
 
-  _HardSerial->setTimeout(PACKET_RESPONSE_WAIT_TIME);
-  
-  if (onConnectCallback)
+void HeatPump::disconnect()
+{
+  connected = false;
+  connectState = CONNECT_IDLE;
+  awaitedReplyHeader = 0;
+  rxLen = 0;
+}
+
+// The handshake runs in the background: connect() opens the port and returns, sync() sends the CONNECT packet
+// once the line has settled and waits for the 0x7a reply, falling back to the other bitrate if there is none.
+// bitrate 0 (or less) tries the preferred bitrate first, then the other one.
+bool HeatPump::startConnect(int bitrate)
+{
+  connected = false;
+  if (transport == nullptr)
   {
-    onConnectCallback();
+    return false;
   }
+  functionsStale = true; // the installer settings may have been changed meanwhile
+  remoteTempSentAt = 0;   // assert the streamed remote temperature again
+  remoteTempTriedAt = 0;
+  registersValid = 0;
+  linkState = LINK_OK;
+  connectAutoBitrate = bitrate <= 0;
+  connectAttempt = 0;
+  beginConnect(connectAutoBitrate ? preferredBitrate : bitrate);
+  return connected;
+}
 
-  // settle before we start sending packets
-  delay(2000);
+void HeatPump::beginConnect(int bitrate)
+{
+  connectBitrate = bitrate;
+  Serial.printf("Connecting at baud rate %d\n", bitrate);
 
-  // send the CONNECT packet twice - need to copy the CONNECT packet locally
-  byte packet[CONNECT_LEN];
-  memcpy(packet, CONNECT, CONNECT_LEN);
+  transport->begin(bitrate);
+  rxLen = 0;
+  awaitedReplyHeader = 0;
 
-  writePacket(packet, CONNECT_LEN); //Send connect command
-  int packetType = readPacket(true);  //Read response packet (blocking)
-  
-  if (packetType != RCVD_PKT_CONNECT_SUCCESS && bitrate == 2400)
+  if (onConnectCallback)
   {
-    return connect(serial, 9600);
+    onConnectCallback();
   }
-  return packetType == RCVD_PKT_CONNECT_SUCCESS;
 
-  
+  // settle before we start sending packets
+  connectState = CONNECT_SETTLING;
+  connectStateSince = millis();
 }
 
-#endif
-
-bool HeatPump::update()
+void HeatPump::advanceConnect()
 {
-
-  if (!canSend(false))
+  if (connectState == CONNECT_SETTLING)
   {
-    // SerialUSB.println("Could not send yet.");
-    return false;
-  }
+    if (millis() - connectStateSince < CONNECT_SETTLE_MS)
+    {
+      return;
+    }
 
-  // SerialUSB.println("Send new command");
+    // need to copy the CONNECT packet locally
+    byte packet[CONNECT_LEN];
+    memcpy_P(packet, CONNECT, CONNECT_LEN);
+    writePacket(packet, CONNECT_LEN); //Send connect command
 
-  //Set flag if the current update is a power setting (will need to add more delay to next command)
-  powerSettingUpdate = wantedSettings.power != currentSettings.power;
-  // SerialUSB.println("Power setting update = " + powerSettingUpdate);
-  if (powerSettingUpdate){
-    packet_sent_delay_interval_ms = PACKET_SENT_INTERVAL_MS + 10000;
-  }else{
-    packet_sent_delay_interval_ms = PACKET_SENT_INTERVAL_MS;
+    connectState = CONNECT_WAIT_REPLY;
+    connectStateSince = millis();
+    return;
   }
 
+  readPacket(); // 0x7a sets connected
+  if (connected)
+  {
+    connectState = CONNECT_IDLE;
+    preferredBitrate = connectBitrate;
+    lastRecv = millis();
+    for (int i = 0; i < INFOMODE_LEN; i++)
+    {
+      pollState[i].due = true;
+    }
+    if (!(capabilities & CAP_PROBED))
+    {
+      probeStep = 0; // first connect to this unit, find out what it answers before polling
+      probeAttempt = 0;
+      probeSent = false;
+    }
+    return;
+  }
 
-  byte packet[PACKET_LEN] = {};
-  createPacket(packet, wantedSettings);
-  writePacket(packet, PACKET_LEN);
+  if (millis() - connectStateSince < PACKET_RESPONSE_WAIT_TIME)
+  {
+    return;
+  }
 
-  currentSettings = wantedSettings;
-  updating = true;
-  lastSendUpdate = millis();
-  return true;
+  if (connectAutoBitrate && ++connectAttempt < 2)
+  {
+    beginConnect(connectBitrate == 2400 ? 9600 : 2400);
+  }
+  else
+  {
+    connectState = CONNECT_IDLE; // failed, the next connect() or sync() starts over
+  }
 }
 
-// Default PACKET_TYPE_DEFAULT = 99;
-void HeatPump::sync(byte packetType)
+// A few seconds without a frame are usually a glitch, so the A/C is first asked for its settings out of turn, then
+// the UART is reopened at the same bitrate and asked again, and only a minute of silence costs the full handshake
+// (2 s settle plus CONNECT) of connect(). Returns false once that handshake has been started.
+bool HeatPump::checkLink()
 {
-  if ((!connected) || (millis() - lastRecv > (PACKET_SENT_INTERVAL_MS * 12)))
+  unsigned long silence = millis() - lastRecv;
+  if (silence < LINK_PROBE_MS)
   {
-    connected = false;
-    connect(NULL);
+    linkState = LINK_OK;
+    return true;
   }
-  else if (sendPending()) // Command to send is pending.
-  { 
-    update();
-  }
-  else if (updating) // Previously send a command, then check for ack.
-  {
-      int packetType = readPacket();
-
-      if (packetType == RCVD_PKT_UPDATE_SUCCESS) // 0xFC 0x61
-      {
-        // call sync() to get the latest settings from the heatpump for autoUpdate, which should now have the updated settings
-        if (autoUpdate)
-        { // this sync will happen regardless, but autoUpdate needs it sooner than later.
-          while (!canSend(true))
-          {
-            delay(10);
-          }
-          sync(RQST_PKT_SETTINGS);
-        }
 
-        // SerialUSB.println("A/C update Success");
-        return;
-      }
-      else
-      {
-        // SerialUSB.println("A/C update failed");
-        return;
-      }
+  if (silence >= LINK_RECONNECT_MS)
+  {
+    busStats.linkReconnects++;
+    startConnect(0);
+    return false;
   }
-  else if (canRead())   //Periodic serial read for any incoming data.
+
+  if (linkState == LINK_OK)
   {
-    readPacket();
+    busStats.linkProbes++;
+    linkState = LINK_PROBING;
+    linkProbesSent = 0;
   }
-  else if (autoUpdate && !firstRun && wantedSettings != currentSettings && packetType == PACKET_TYPE_DEFAULT)
+  else if (linkState == LINK_PROBING && silence >= LINK_RESET_MS)
   {
-    update();
+    busStats.linkResets++;
+    linkState = LINK_RESET;
+    linkProbesSent = 0;
+    transport->begin(connectBitrate);
+    rxLen = 0;
+    awaitedReplyHeader = 0; // whatever was outstanding is lost, the command queue and update see a timeout
   }
 
-  
-  if (canSend(true))//    Fetch new A/C status if possible
+  if (linkProbesSent < LINK_PROBES && millis() - linkProbeAt >= LINK_PROBE_INTERVAL_MS)
   {
-    byte packet[PACKET_LEN] = {};
-    createInfoPacket(packet, packetType);
-    writePacket(packet, PACKET_LEN);
+    pollState[RQST_PKT_SETTINGS].due = true; // every unit answers it, sent as soon as the bus is free
+    linkProbesSent++;
+    linkProbeAt = millis();
   }
-  
+  return true;
 }
 
-bool HeatPump::sendPending()
+byte HeatPump::getLinkState()
 {
-  return wantedSettings != currentSettings;
+  return linkState;
 }
 
-void HeatPump::enableExternalUpdate()
+bool HeatPump::isConnecting()
 {
-  autoUpdate = true;
-  externalUpdate = true;
+  return connectState != CONNECT_IDLE;
 }
 
-void HeatPump::disableExternalUpdate()
+int HeatPump::getPreferredBitrate()
 {
-  externalUpdate = false;
+  return preferredBitrate;
 }
 
-void HeatPump::enableAutoUpdate()
+void HeatPump::setPreferredBitrate(int bitrate)
 {
-  autoUpdate = true;
+  if (bitrate == 2400 || bitrate == 9600)
+  {
+    preferredBitrate = bitrate;
+  }
 }
 
-void HeatPump::disableAutoUpdate()
+uint16_t HeatPump::getCapabilities()
 {
-  autoUpdate = false;
+  return capabilities;
 }
 
-heatpumpSettings HeatPump::getSettings()
+void HeatPump::setCapabilities(uint16_t capabilities)
 {
-  return currentSettings;
+  this->capabilities = capabilities;
+  if (capabilities & CAP_HALF_DEGREE)
+  {
+    tempMode = true; // accept half degree set points before the first settings reply
+  }
 }
 
-bool HeatPump::isConnected()
+bool HeatPump::hasCapability(uint16_t capability)
 {
-  return connected;
+  return (capabilities & capability) == capability;
 }
 
-void HeatPump::setSettings(heatpumpSettings settings)
+bool HeatPump::isProbing()
 {
-  setPowerSetting(settings.power);
-  setModeSetting(settings.mode);
-  setTemperature(settings.temperature);
-  setFanSpeed(settings.fan);
-  setVaneSetting(settings.vane);
-  setWideVaneSetting(settings.wideVane);
-
-  
+  return probeStep >= 0;
 }
 
-bool HeatPump::getPowerSettingBool()
+HeatPump::TimingProfile HeatPump::getTimingProfile()
 {
-  return currentSettings.power == POWER_MAP[1] ? true : false;
+  return timing;
 }
 
-void HeatPump::setPowerSetting(bool setting)
+void HeatPump::setTimingProfile(const TimingProfile &profile)
 {
-
-  // if (strcmp(wantedSettings.power, lookupByteMapIndex(POWER_MAP, 2, POWER_MAP[setting ? 1 : 0]) > -1 ? POWER_MAP[setting ? 1 : 0] : POWER_MAP[0] == 0)){
-  //   powerSettingUpdate = false;
-  // }else{
-  //   powerSettingUpdate = true;
-  // }
-
-  wantedSettings.power = lookupByteMapIndex(POWER_MAP, 2, POWER_MAP[setting ? 1 : 0]) > -1 ? POWER_MAP[setting ? 1 : 0] : POWER_MAP[0];
+  timing = profile;
+  timing.replyMs = clampMs(timing.replyMs, 0, RESPONSE_WAIT_MAX_MS);
+  timing.replyDevMs = clampMs(timing.replyDevMs, 0, RESPONSE_WAIT_MAX_MS);
+  timing.powerSettleMs = clampMs(timing.powerSettleMs, POWER_SETTLE_MIN_MS, POWER_SETTLE_MAX_MS);
+  timing.settleMs = clampMs(timing.settleMs, 0, SETTLE_MAX_MS);
+  updateResponseWait();
 }
 
-const char *HeatPump::getPowerSetting()
+unsigned long HeatPump::getResponseWaitMs()
 {
-  return currentSettings.power;
+  return responseWaitMs;
 }
 
-void HeatPump::setPowerSetting(const char *setting)
+HeatPump::BusStats HeatPump::getBusStats()
 {
-  int index = lookupByteMapIndex(POWER_MAP, 2, setting);
-  if (index < 0)
-  {
-    index = 0;
-  }
-
-
-  // if (strcmp(wantedSettings.power, POWER_MAP[index]) == 0){
-  //     powerSettingUpdate = false;
-  // }else{
-  //   powerSettingUpdate = true;
-  // }
+  return busStats;
+}
 
-  wantedSettings.power = POWER_MAP[index];
+void HeatPump::resetBusStats()
+{
+  busStats = BusStats();
+  busStats.since = millis();
+  busStatsSlot = -1;
+}
 
+void HeatPump::setTraceEnabled(bool enabled)
+{
+#if HEATPUMP_TRACE_FRAMES > 0
+  traceEnabled = enabled;
+#endif
 }
 
-const char *HeatPump::getModeSetting()
+bool HeatPump::isTraceEnabled()
 {
-  return currentSettings.mode;
+  return traceEnabled;
 }
 
-void HeatPump::setModeSetting(const char *setting)
+bool HeatPump::popTrace(TraceEntry &entry)
 {
-  int index = lookupByteMapIndex(MODE_MAP, 5, setting);
-  if (index > -1)
-  {
-    wantedSettings.mode = MODE_MAP[index];
-  }
-  else
+#if HEATPUMP_TRACE_FRAMES > 0
+  if (traceCount == 0)
   {
-    wantedSettings.mode = MODE_MAP[0];
+    return false;
   }
+  entry = traceRing[traceHead];
+  traceHead = (traceHead + 1) % HEATPUMP_TRACE_FRAMES;
+  traceCount--;
+  return true;
+#else
+  return false;
+#endif
 }
 
-float HeatPump::getTemperature()
+uint32_t HeatPump::getTraceDropped()
 {
-  return currentSettings.temperature;
+#if HEATPUMP_TRACE_FRAMES > 0
+  return traceDropped;
+#else
+  return 0;
+#endif
 }
 
-void HeatPump::setTemperature(float setting)
+size_t HeatPump::formatTrace(const TraceEntry &entry, char *buffer, size_t size)
 {
-  if (!tempMode)
+  static const char digits[] = "0123456789abcdef";
+  if (size == 0)
   {
-    wantedSettings.temperature = lookupByteMapIndex(TEMP_MAP, 16, (int)(setting + 0.5)) > -1 ? setting : TEMP_MAP[0];
+    return 0;
   }
-  else
+  size_t length = 0;
+  for (int i = 0; i < entry.length; i++)
   {
-    setting = setting * 2;
-    setting = round(setting);
-    setting = setting / 2;
-    wantedSettings.temperature = setting < 10 ? 10 : (setting > 31 ? 31 : setting);
+    if (length + (i > 0 ? 3 : 2) >= size) // whole bytes only, and room for the terminator
+    {
+      break;
+    }
+    if (i > 0)
+    {
+      buffer[length++] = ' ';
+    }
+    buffer[length++] = digits[entry.frame[i] >> 4];
+    buffer[length++] = digits[entry.frame[i] & 0x0F];
   }
+  buffer[length] = '\0';
+  return length;
 }
 
-void HeatPump::setRemoteTemperature(float setting)
+// Called for every frame, so it only copies the bytes; the oldest entry is overwritten when the ring is full.
+#if HEATPUMP_TRACE_FRAMES > 0
+void HeatPump::traceFrame(byte direction, const byte *frame, int length)
 {
-  byte packet[PACKET_LEN] = {};
-
-  prepareSetPacket(packet, PACKET_LEN);
-
-  packet[5] = 0x07;
-  if (setting > 0)
+  if (!traceEnabled)
   {
-    packet[6] = 0x01;
-    setting = setting * 2;
-    setting = round(setting);
-    setting = setting / 2;
-    float temp1 = 3 + ((setting - 10) * 2);
-    packet[7] = (int)temp1;
-    float temp2 = (setting * 2) + 128;
-    packet[8] = (int)temp2;
+    return;
   }
-  else
+  if (traceCount == HEATPUMP_TRACE_FRAMES)
   {
-    packet[6] = 0x00;
-    packet[8] = 0x80; // MHK1 send 80, even though it could be 00, since ControlByte is 00
+    traceHead = (traceHead + 1) % HEATPUMP_TRACE_FRAMES;
+    traceCount--;
+    traceDropped++;
   }
-  // add the checksum
-  byte chkSum = checkSum(packet, 21);
-  packet[21] = chkSum;
-  while (!canSend(false))
+  TraceEntry &entry = traceRing[(traceHead + traceCount) % HEATPUMP_TRACE_FRAMES];
+  entry.time = millis();
+  entry.direction = direction;
+  if (length > TRACE_FRAME_LEN)
   {
-    delay(10);
+    length = TRACE_FRAME_LEN;
   }
-  writePacket(packet, PACKET_LEN);
-}
-
-const char *HeatPump::getFanSpeed()
-{
-  return currentSettings.fan;
+  entry.length = length;
+  memcpy(entry.frame, frame, length);
+  traceCount++;
 }
+#endif
 
-void HeatPump::setFanSpeed(const char *setting)
+int HeatPump::findBusStatsSlot(byte type, byte command)
 {
-  int index = lookupByteMapIndex(FAN_MAP, 6, setting);
-  if (index > -1)
-  {
-    wantedSettings.fan = FAN_MAP[index];
-  }
-  else
+  for (int i = 0; i < STATS_COMMANDS_LEN; i++)
   {
-    wantedSettings.fan = FAN_MAP[0];
+    CommandStats &slot = busStats.commands[i];
+    if (slot.type == 0)
+    {
+      slot.type = type;
+      slot.command = command;
+      return i;
+    }
+    if (slot.type == type && slot.command == command)
+    {
+      return i;
+    }
   }
+  return -1;
 }
 
-const char *HeatPump::getVaneSetting()
+uint16_t HeatPump::capabilityForCommand(byte command)
 {
-  return currentSettings.vane;
+  switch (command)
+  {
+  case 0x02: return CAP_SETTINGS;
+  case 0x03: return CAP_ROOM_TEMP;
+  case 0x05: return CAP_TIMERS;
+  case 0x06: return CAP_STATUS;
+  case 0x09: return CAP_STANDBY;
+  case 0x20:
+  case 0x22: return CAP_FUNCTIONS;
+  default:   return 0;
+  }
 }
 
-void HeatPump::setVaneSetting(const char *setting)
+// Send each PROBE_COMMANDS request once (twice if unanswered), the replies set their CAP_* bit in processPacket().
+// Called by sync() instead of the info poll until every request has been answered or has timed out.
+void HeatPump::probeCapabilities()
 {
-  int index = lookupByteMapIndex(VANE_MAP, 7, setting);
-  if (index > -1)
+  if (awaitingReply())
   {
-    wantedSettings.vane = VANE_MAP[index];
+    return;
   }
-  else
+
+  if (probeSent)
   {
-    wantedSettings.vane = VANE_MAP[0];
+    probeSent = false;
+    byte command = pgm_read_byte(&PROBE_COMMANDS[probeStep]);
+    if ((capabilities & capabilityForCommand(command)) || ++probeAttempt >= PROBE_MAX_ATTEMPTS)
+    {
+      probeStep++;
+      probeAttempt = 0;
+    }
   }
+
+  if (probeStep >= PROBE_COMMANDS_LEN)
+  {
+    probeStep = -1;
+    capabilities |= CAP_PROBED;
+    return;
+  }
+
+  if (canSend(true))
+  {
+    byte packet[PACKET_LEN] = {};
+    prepareInfoPacket(packet, PACKET_LEN);
+    packet[5] = pgm_read_byte(&PROBE_COMMANDS[probeStep]);
+    packet[21] = checkSum(packet, 21);
+    writePacket(packet, PACKET_LEN);
+    probeSent = true;
+  }
+}
+
+bool HeatPump::update()
+{
+
+  if (updating || pendingFields == 0 || !canSend(false)) // one control packet in flight at a time
+  {
+    // SerialUSB.println("Could not send yet.");
+    return false;
+  }
+
+  // SerialUSB.println("Send new command");
+
+  //Set flag if the current update is a power setting (will need to add more delay to next command)
+  powerSettingUpdate = (pendingFields & FIELD_POWER) != 0;
+  // SerialUSB.println("Power setting update = " + powerSettingUpdate);
+  if (powerSettingUpdate){
+    packet_sent_delay_interval_ms = timing.powerSettleMs;
+  }else{
+    packet_sent_delay_interval_ms = PACKET_SENT_INTERVAL_MS;
+  }
+
+
+  // currentSettings only takes the new values once the A/C has acknowledged them, see processUpdate()
+  // only the fields a setter has changed go into the packet, the others keep whatever the A/C has
+  createPacket(updatePacket, wantedSettings, pendingFields);
+  sentSettings = wantedSettings;
+  inFlightFields = pendingFields;
+  pendingFields = 0;
+  updateSequence++;
+  updateAttempts = 1;
+  updateAcked = false;
+  writePacket(updatePacket, PACKET_LEN);
+
+  updating = true;
+  lastSendUpdate = millis();
+  wantedChangePending = false;
+  return true;
+}
+
+// Confirm or retransmit the control packet in flight. Called by sync() after readPacket().
+void HeatPump::processUpdate()
+{
+  if (!updating)
+  {
+    return;
+  }
+
+  if (updateAcked) // 0xFC 0x61 received
+  {
+    updating = false;
+    byte changedFields = diffSettings(sentSettings, currentSettings) & inFlightFields;
+    markState(0, changedFields);
+    copySettingsFields(currentSettings, sentSettings, inFlightFields);
+    registersValid &= ~(1 << findRegister(0x02)); // currentSettings no longer matches the cached reply
+    powerSettleCheck = (inFlightFields & FIELD_POWER) != 0;
+    // read the settings back once the unit has had its learned settle time, the A/C may have adjusted them
+    settleFields = inFlightFields & ~FIELD_POWER; // a power change takes much longer, see learnPowerSettle()
+    settleAckAt = millis();
+    settleReadbacks = 0;
+    readbackPending = true;
+    readbackAt = settleAckAt + timing.settleMs;
+    inFlightFields = 0;
+
+    queueEvent(EVENT_UPDATE_RESULT, updateSequence, CMD_RESULT_OK);
+    if (changedFields)
+    {
+      queueEvent(EVENT_SETTINGS);
+    }
+    return;
+  }
+
+  if (awaitingReply())
+  {
+    return;
+  }
+
+  if (updateAttempts >= UPDATE_MAX_ATTEMPTS)
+  {
+    // give up, currentSettings still holds what the A/C last reported. Fields set again while the packet was in
+    // flight stay pending, the others go back to the A/C's values.
+    updating = false;
+    copySettingsFields(wantedSettings, currentSettings, inFlightFields & ~pendingFields);
+    pendingFields &= diffSettings(wantedSettings, currentSettings);
+    inFlightFields = 0;
+    setInfoModeIndex(RQST_PKT_SETTINGS);
+
+    queueEvent(EVENT_UPDATE_RESULT, updateSequence, CMD_RESULT_TIMEOUT);
+    return;
+  }
+
+  // no ack, send the same packet again after a growing pause
+  unsigned long backoff = (unsigned long)UPDATE_RETRY_BACKOFF_MS << (updateAttempts - 1);
+  if (millis() - lastSend >= backoff && millis() - lastReply >= PACKET_GAP_MS)
+  {
+    updateAttempts++;
+    writePacket(updatePacket, PACKET_LEN);
+  }
+}
+
+// Default PACKET_TYPE_DEFAULT = 99;
+void HeatPump::sync(byte packetType)
+{
+  if (connectState != CONNECT_IDLE)
+  {
+    advanceConnect();
+    return;
+  }
+
+  if (!connected)
+  {
+    startConnect(0);
+    return;
+  }
+  else
+  {
+    readPacket(); // pick up every reply already waiting in the UART buffer
+    if (!checkLink())
+    {
+      return;
+    }
+    checkReplyTimeout();
+
+    processUpdate();
+    processCommandQueue();
+
+    if (sendPending() && coalesceWindowElapsed()) // Command to send is pending and the setters have settled.
+    {
+      update();
+    }
+    else if (autoUpdate && !firstRun && sendPending() && (packetType == PACKET_TYPE_DEFAULT || packetType == PACKET_TYPE_NO_POLL))
+    {
+      update();
+    }
+
+    queueRemoteTemperature();
+    sendQueuedCommand(); // remote temperature, functions, custom packets
+  }
+
+  if (readbackPending && (long)(millis() - readbackAt) >= 0)
+  {
+    readbackPending = false;
+    setInfoModeIndex(RQST_PKT_SETTINGS);
+  }
+
+  if (probeStep >= 0)
+  {
+    probeCapabilities();
+  }
+  else if (canSend(true))//    Fetch the stalest A/C value as soon as the previous request has been answered
+  {
+    int index = selectInfoIndex(packetType);
+    if (index >= 0)
+    {
+      byte packet[PACKET_LEN] = {};
+      createInfoPacket(packet, index);
+      writePacket(packet, PACKET_LEN);
+    }
+  }
+
+  // the bus work is done for this call, now run the callbacks of what changed
+  if (!manualDispatch)
+  {
+    dispatchEvents();
+  }
+}
+
+bool HeatPump::sendPending()
+{
+  return pendingFields != 0;
+}
+
+bool HeatPump::isUpdating()
+{
+  return updating;
+}
+
+unsigned int HeatPump::getUpdateSequence()
+{
+  return updateSequence;
+}
+
+byte HeatPump::getPendingFields()
+{
+  return pendingFields;
+}
+
+byte HeatPump::getInFlightFields()
+{
+  return inFlightFields;
+}
+
+unsigned long HeatPump::getFieldChangedAt(byte field)
+{
+  for (int i = 0; i < SETTINGS_FIELD_COUNT; i++)
+  {
+    if (field == (1 << i))
+    {
+      return fieldChangedAt[i];
+    }
+  }
+  return 0;
+}
+
+uint32_t HeatPump::getStateSequence()
+{
+  return stateSequence;
+}
+
+uint16_t HeatPump::getChangedSince(uint32_t sequence)
+{
+  uint16_t fields = 0;
+  for (int i = 0; i < STATE_FIELD_COUNT; i++)
+  {
+    if (stateFieldSequence[i] > sequence)
+    {
+      fields |= 1 << i;
+    }
+  }
+  return fields;
+}
+
+unsigned long HeatPump::getReceivedAt(uint16_t field)
+{
+  for (int i = 0; i < STATE_FIELD_COUNT; i++)
+  {
+    if (field == (1 << i))
+    {
+      return stateReceivedAt[i];
+    }
+  }
+  return 0;
+}
+
+// Stamp the fields a reply carried and give the changed ones a new sequence number. A field seen for the first time
+// counts as changed, so getChangedSince(0) covers everything received so far.
+void HeatPump::markState(uint16_t received, uint16_t changed)
+{
+  changed |= received & ~stateReceived;
+  stateReceived |= received;
+  if (changed)
+  {
+    stateSequence++;
+  }
+
+  unsigned long now = millis();
+  for (int i = 0; i < STATE_FIELD_COUNT; i++)
+  {
+    if (received & (1 << i))
+    {
+      stateReceivedAt[i] = now;
+    }
+    if (changed & (1 << i))
+    {
+      stateFieldSequence[i] = stateSequence;
+    }
+  }
+}
+
+void HeatPump::enableExternalUpdate()
+{
+  autoUpdate = true;
+  externalUpdate = true;
+}
+
+void HeatPump::disableExternalUpdate()
+{
+  externalUpdate = false;
+}
+
+void HeatPump::enableAutoUpdate()
+{
+  autoUpdate = true;
+}
+
+void HeatPump::disableAutoUpdate()
+{
+  autoUpdate = false;
+}
+
+void HeatPump::setCoalesceWindow(unsigned long windowMs)
+{
+  coalesceWindowMs = windowMs;
+}
+
+void HeatPump::enableManualDispatch()
+{
+  manualDispatch = true;
+}
+
+void HeatPump::disableManualDispatch()
+{
+  manualDispatch = false;
+}
+
+void HeatPump::setEventMask(byte mask)
+{
+  eventMask = mask;
+}
+
+unsigned int HeatPump::getDroppedEvents()
+{
+  return droppedEvents;
+}
+
+// State events only say that something changed, the callback reads the latest values when it runs, so a second
+// one of the same type is not queued. Update results carry their sequence number and are all kept.
+void HeatPump::queueEvent(byte type, unsigned int sequence, int result)
+{
+  if (!(eventMask & type))
+  {
+    return;
+  }
+
+  if (type != EVENT_UPDATE_RESULT)
+  {
+    for (int i = 0; i < eventCount; i++)
+    {
+      if (eventQueue[(eventHead + i) % EVENT_QUEUE_LEN].type == type)
+      {
+        return;
+      }
+    }
+  }
+
+  if (eventCount >= EVENT_QUEUE_LEN)
+  {
+    droppedEvents++;
+    return;
+  }
+
+  queuedEvent &event = eventQueue[(eventHead + eventCount) % EVENT_QUEUE_LEN];
+  event.type = type;
+  event.sequence = sequence;
+  event.result = result;
+  eventCount++;
+}
+
+// Only the events queued before the call are run, a callback that causes new ones does not keep this loop going.
+void HeatPump::dispatchEvents()
+{
+  for (int pending = eventCount; pending > 0 && eventCount > 0; pending--)
+  {
+    queuedEvent event = eventQueue[eventHead];
+    eventHead = (eventHead + 1) % EVENT_QUEUE_LEN;
+    eventCount--;
+
+    switch (event.type)
+    {
+    case EVENT_SETTINGS:
+      if (settingsChangedCallback)
+      {
+        settingsChangedCallback();
+      }
+      break;
+    case EVENT_STATUS:
+      if (statusChangedCallback)
+      {
+        statusChangedCallback(currentStatus);
+      }
+      break;
+    case EVENT_ROOM_TEMP:
+      if (roomTempChangedCallback)
+      {
+        roomTempChangedCallback(currentStatus.roomTemperature);
+      }
+      break;
+    case EVENT_UPDATE_RESULT:
+      if (updateResultCallback)
+      {
+        updateResultCallback(event.sequence, event.result);
+      }
+      break;
+    }
+  }
+}
+
+heatpumpSettings HeatPump::getSettings()
+{
+  heatpumpSettings settings {};
+  if (settingsReceived)
+  {
+    settings.power = toString(currentSettings.power);
+    settings.mode = toString(currentSettings.mode);
+    settings.temperature = currentSettings.temperature / 2.0;
+    settings.fan = toString(currentSettings.fan);
+    settings.vane = toString(currentSettings.vane);
+    settings.wideVane = toString(currentSettings.wideVane);
+    settings.iSee = currentSettings.iSee;
+    settings.connected = connected;
+  }
+  return settings;
+}
+
+HeatPump::Settings HeatPump::getTypedSettings()
+{
+  return currentSettings;
+}
+
+bool HeatPump::isConnected()
+{
+  return connected;
+}
+
+void HeatPump::setSettings(heatpumpSettings settings)
+{
+  setPowerSetting(settings.power);
+  setModeSetting(settings.mode);
+  setTemperature(settings.temperature);
+  setFanSpeed(settings.fan);
+  setVaneSetting(settings.vane);
+  setWideVaneSetting(settings.wideVane);
+
+  
+}
+
+void HeatPump::setTypedSettings(const Settings &settings)
+{
+  setPowerSetting(settings.power);
+  setModeSetting(settings.mode);
+  setTemperatureHalfDeg(settings.temperature);
+  setFanSpeed(settings.fan);
+  setVaneSetting(settings.vane);
+  setWideVaneSetting(settings.wideVane);
+}
+
+bool HeatPump::getPowerSettingBool()
+{
+  return currentSettings.power == Power::On;
+}
+
+void HeatPump::setPowerSetting(bool setting)
+{
+  setPowerSetting(setting ? Power::On : Power::Off);
+}
+
+const char *HeatPump::getPowerSetting()
+{
+  return toString(currentSettings.power);
+}
+
+void HeatPump::setPowerSetting(const char *setting)
+{
+  Power power = Power::Off; // unknown values switch the unit off, as before
+  fromString(setting, power);
+  setPowerSetting(power);
+}
+
+HeatPump::Power HeatPump::getPower()
+{
+  return currentSettings.power;
+}
+
+void HeatPump::setPowerSetting(Power setting)
+{
+  wantedSettings.power = setting;
+  wantedSettingsChanged(FIELD_POWER);
+}
+
+const char *HeatPump::getModeSetting()
+{
+  return toString(currentSettings.mode);
+}
+
+void HeatPump::setModeSetting(const char *setting)
+{
+  Mode mode = Mode::Heat;
+  fromString(setting, mode);
+  setModeSetting(mode);
+}
+
+HeatPump::Mode HeatPump::getMode()
+{
+  return currentSettings.mode;
+}
+
+void HeatPump::setModeSetting(Mode setting)
+{
+  wantedSettings.mode = setting;
+  wantedSettingsChanged(FIELD_MODE);
+}
+
+float HeatPump::getTemperature()
+{
+  return currentSettings.temperature / 2.0;
+}
+
+void HeatPump::setTemperature(float setting)
+{
+  setTemperatureHalfDeg(setting < 0 ? 0 : (uint8_t)round(setting * 2 > 255 ? 255 : setting * 2));
+}
+
+uint8_t HeatPump::getTemperatureHalfDeg()
+{
+  return currentSettings.temperature;
+}
+
+void HeatPump::setTemperatureHalfDeg(uint8_t halfDegrees)
+{
+  halfDegrees = halfDegrees < TEMP_HALF_DEG_MIN ? TEMP_HALF_DEG_MIN : (halfDegrees > TEMP_HALF_DEG_MAX ? TEMP_HALF_DEG_MAX : halfDegrees);
+  if (!tempMode)
+  {
+    // whole degrees between 16 and 31 only
+    halfDegrees = (halfDegrees + 1) & ~1;
+    halfDegrees = halfDegrees < TEMP_HALF_DEG_INDEX_MIN ? TEMP_HALF_DEG_INDEX_MIN : halfDegrees;
+  }
+  wantedSettings.temperature = halfDegrees;
+  wantedSettingsChanged(FIELD_TEMPERATURE);
+}
+
+bool HeatPump::setRemoteTemperature(float setting, heatpumpCommandCallback done)
+{
+  byte packet[PACKET_LEN] = {};
+  createRemoteTemperaturePacket(packet, setting);
+  return queueCommand(packet, PACKET_LEN, CMD_PRIORITY_HIGH, done);
+}
+
+// A sensor may report far more often than the unit needs, so only the latest value is kept and queueRemoteTemperature()
+// decides when it goes on the bus. Passing 0 hands the room temperature back to the unit's own sensor.
+void HeatPump::streamRemoteTemperature(float setting)
+{
+  remoteTempStreaming = true;
+  remoteTemp = setting > 0 ? setting : 0;
+  remoteTempAt = millis();
+}
+
+// deadband: change (in °C) from the acknowledged value that is worth sending. minIntervalMs: pause between two sends,
+// failed ones included. refreshMs: the value is sent again after this long, so the unit does not fall back to its
+// own sensor. timeoutMs: without a new value for this long the unit's own sensor is used again, 0 never gives up.
+void HeatPump::setRemoteTemperatureTiming(float deadband, unsigned long minIntervalMs, unsigned long refreshMs, unsigned long timeoutMs)
+{
+  remoteTempDeadband = deadband;
+  remoteTempMinIntervalMs = minIntervalMs;
+  remoteTempRefreshMs = refreshMs;
+  remoteTempTimeoutMs = timeoutMs;
+}
+
+float HeatPump::getRemoteTemperature()
+{
+  return remoteTempSent;
+}
+
+unsigned long HeatPump::getRemoteTemperatureSentAt()
+{
+  return remoteTempSentAt;
+}
+
+// Called by sync(): queue the streamed value if it is due, one at a time.
+void HeatPump::queueRemoteTemperature()
+{
+  if (!remoteTempStreaming || remoteTempQueued ||
+      (remoteTempTriedAt != 0 && millis() - remoteTempTriedAt < remoteTempMinIntervalMs))
+  {
+    return;
+  }
+
+  float wanted = remoteTemp;
+  if (wanted > 0 && remoteTempTimeoutMs > 0 && millis() - remoteTempAt > remoteTempTimeoutMs)
+  {
+    wanted = 0; // the sensor went quiet
+  }
+  bool changed = (wanted > 0) != (remoteTempSent > 0) || fabs(wanted - remoteTempSent) >= remoteTempDeadband;
+  bool refresh = wanted > 0 && millis() - remoteTempSentAt >= remoteTempRefreshMs;
+  if (remoteTempSentAt != 0 && !changed && !refresh)
+  {
+    return;
+  }
+
+  byte packet[PACKET_LEN] = {};
+  createRemoteTemperaturePacket(packet, wanted);
+  if (queueCommand(packet, PACKET_LEN, CMD_PRIORITY_HIGH, nullptr))
+  {
+    remoteTempQueued = true;
+    remoteTempTriedAt = millis();
+  }
+}
+
+void HeatPump::createRemoteTemperaturePacket(byte *packet, float setting)
+{
+  prepareSetPacket(packet, PACKET_LEN);
+
+  packet[5] = REMOTE_TEMP_SET;
+  if (setting > 0)
+  {
+    packet[6] = 0x01;
+    setting = setting * 2;
+    setting = round(setting);
+    setting = setting / 2;
+    float temp1 = 3 + ((setting - 10) * 2);
+    packet[7] = (int)temp1;
+    float temp2 = (setting * 2) + 128;
+    packet[8] = (int)temp2;
+  }
+  else
+  {
+    packet[6] = 0x00;
+    packet[8] = 0x80; // MHK1 send 80, even though it could be 00, since ControlByte is 00
+  }
+  // add the checksum
+  byte chkSum = checkSum(packet, 21);
+  packet[21] = chkSum;
+}
+
+const char *HeatPump::getFanSpeed()
+{
+  return toString(currentSettings.fan);
+}
+
+void HeatPump::setFanSpeed(const char *setting)
+{
+  Fan fan = Fan::Auto;
+  fromString(setting, fan);
+  setFanSpeed(fan);
+}
+
+HeatPump::Fan HeatPump::getFan()
+{
+  return currentSettings.fan;
+}
+
+void HeatPump::setFanSpeed(Fan setting)
+{
+  wantedSettings.fan = setting;
+  wantedSettingsChanged(FIELD_FAN);
+}
+
+const char *HeatPump::getVaneSetting()
+{
+  return toString(currentSettings.vane);
+}
+
+void HeatPump::setVaneSetting(const char *setting)
+{
+  Vane vane = Vane::Auto;
+  fromString(setting, vane);
+  setVaneSetting(vane);
+}
+
+HeatPump::Vane HeatPump::getVane()
+{
+  return currentSettings.vane;
+}
+
+void HeatPump::setVaneSetting(Vane setting)
+{
+  wantedSettings.vane = setting;
+  wantedSettingsChanged(FIELD_VANE);
 }
 
 const char *HeatPump::getWideVaneSetting()
 {
-  return currentSettings.wideVane;
+  return toString(currentSettings.wideVane);
 }
 
 void HeatPump::setWideVaneSetting(const char *setting)
 {
-  int index = lookupByteMapIndex(WIDEVANE_MAP, 7, setting);
-  if (index > -1)
-  {
-    wantedSettings.wideVane = WIDEVANE_MAP[index];
-  }
-  else
-  {
-    wantedSettings.wideVane = WIDEVANE_MAP[0];
-  }
+  WideVane wideVane = WideVane::FarLeft;
+  fromString(setting, wideVane);
+  setWideVaneSetting(wideVane);
+}
+
+HeatPump::WideVane HeatPump::getWideVane()
+{
+  return currentSettings.wideVane;
+}
+
+void HeatPump::setWideVaneSetting(WideVane setting)
+{
+  wantedSettings.wideVane = setting;
+  wantedSettingsChanged(FIELD_WIDEVANE);
 }
 
 bool HeatPump::getIseeBool()
@@ -519,6 +1306,56 @@ bool HeatPump::getIseeBool()
   return currentSettings.iSee;
 }
 
+const char *HeatPump::toString(Power value)
+{
+  return POWER_NAMES[(int)value];
+}
+
+const char *HeatPump::toString(Mode value)
+{
+  return MODE_NAMES[(int)value];
+}
+
+const char *HeatPump::toString(Fan value)
+{
+  return FAN_NAMES[(int)value];
+}
+
+const char *HeatPump::toString(Vane value)
+{
+  return VANE_NAMES[(int)value];
+}
+
+const char *HeatPump::toString(WideVane value)
+{
+  return WIDEVANE_NAMES[(int)value];
+}
+
+bool HeatPump::fromString(const char *name, Power &value)
+{
+  return enumFromName(POWER_NAMES, name, value);
+}
+
+bool HeatPump::fromString(const char *name, Mode &value)
+{
+  return enumFromName(MODE_NAMES, name, value);
+}
+
+bool HeatPump::fromString(const char *name, Fan &value)
+{
+  return enumFromName(FAN_NAMES, name, value);
+}
+
+bool HeatPump::fromString(const char *name, Vane &value)
+{
+  return enumFromName(VANE_NAMES, name, value);
+}
+
+bool HeatPump::fromString(const char *name, WideVane &value)
+{
+  return enumFromName(WIDEVANE_NAMES, name, value);
+}
+
 heatpumpStatus HeatPump::getStatus()
 {
   return currentStatus;
@@ -571,21 +1408,21 @@ void HeatPump::setRoomTempChangedCallback(ROOM_TEMP_CHANGED_CALLBACK_SIGNATURE)
   this->roomTempChangedCallback = roomTempChangedCallback;
 }
 
-// #### WARNING, THE FOLLOWING METHOD CAN F--K YOUR HP UP, USE WISELY ####
-void HeatPump::sendCustomPacket(byte data[], int packetLength)
+void HeatPump::setUpdateResultCallback(UPDATE_RESULT_CALLBACK_SIGNATURE)
 {
-  while (!canSend(false))
-  {
-    delay(10);
-  }
+  this->updateResultCallback = updateResultCallback;
+}
 
+// #### WARNING, THE FOLLOWING METHOD CAN F--K YOUR HP UP, USE WISELY ####
+bool HeatPump::sendCustomPacket(byte data[], int packetLength, heatpumpCommandCallback done)
+{
   packetLength += 2;                                                      // +2 for first header byte and checksum
   packetLength = (packetLength > PACKET_LEN) ? PACKET_LEN : packetLength; // ensure we are not exceeding PACKET_LEN
   byte packet[packetLength];
-  packet[0] = HEADER[0]; // add first header byte
+  packet[0] = pgm_read_byte(&HEADER[0]); // add first header byte
 
   // add data
-  for (int i = 0; i < packetLength; i++)
+  for (int i = 0; i < packetLength - 2; i++)
   {
     packet[(i + 1)] = data[i];
   }
@@ -594,88 +1431,333 @@ void HeatPump::sendCustomPacket(byte data[], int packetLength)
   byte chkSum = checkSum(packet, (packetLength - 1));
   packet[(packetLength - 1)] = chkSum;
 
-  writePacket(packet, packetLength);
+  return queueCommand(packet, packetLength, CMD_PRIORITY_NORMAL, done);
 }
 
 // Private Methods //////////////////////////////////////////////////////////////
 
-int HeatPump::lookupByteMapIndex(const int valuesMap[], int len, int lookupValue)
+bool HeatPump::canSend(bool isInfo)
+
 {
-  for (int i = 0; i < len; i++)
+  // Requests are clocked by the replies: the next one goes out as soon as the previous one has been
+  // answered (plus a short gap), or once PACKET_RESPONSE_WAIT_TIME has passed without an answer.
+  if (awaitingReply() || millis() - lastReply < PACKET_GAP_MS)
   {
-    if (valuesMap[i] == lookupValue)
+    return false;
+  }
+
+  if (isInfo)
+  {
+     if (powerSettingUpdate  && millis() - lastSendUpdate < timing.powerSettleMs ){
+    //  if ( millis() - lastSendUpdate < 10000 ){
+        return false;
+     }
+    return true;
+  }
+  else
+  {
+    if (!updating && !powerSettingUpdate)
     {
-      return i;
+      // the previous command has been acknowledged and nothing else is in flight, no need to wait out the interval
+      return true;
     }
+    return millis() - lastSendUpdate > (unsigned long)packet_sent_delay_interval_ms;
+
   }
-  return -1;
 }
 
-int HeatPump::lookupByteMapIndex(const char *valuesMap[], int len, const char *lookupValue)
+// Called by every setter. A field is pending while its wanted value differs from the value the A/C will hold once
+// the packet in flight (if it carries that field) is acknowledged, so setting a field back cancels it.
+// A burst of setter calls (HA slider, web form) is merged into a single 0x41 packet:
+// sync() waits until no setter has been called for coalesceWindowMs before sending.
+void HeatPump::wantedSettingsChanged(byte field)
 {
-  for (int i = 0; i < len; i++)
+  const Settings &expected = (inFlightFields & field) ? sentSettings : currentSettings;
+  if (!(diffSettings(wantedSettings, expected) & field))
   {
-    if (strcasecmp(valuesMap[i], lookupValue) == 0)
+    pendingFields &= ~field;
+    return;
+  }
+
+  pendingFields |= field;
+  lastWantedChange = millis();
+  for (int i = 0; i < SETTINGS_FIELD_COUNT; i++)
+  {
+    if (field == (1 << i))
     {
-      return i;
+      fieldChangedAt[i] = lastWantedChange;
     }
   }
-  return -1;
+  if (!wantedChangePending)
+  {
+    firstWantedChange = lastWantedChange;
+    wantedChangePending = true;
+  }
 }
 
-const char *HeatPump::lookupByteMapValue(const char *valuesMap[], const byte byteMap[], int len, byte byteValue)
+byte HeatPump::diffSettings(const Settings &a, const Settings &b)
 {
-  for (int i = 0; i < len; i++)
+  byte fields = 0;
+  if (a.power != b.power) fields |= FIELD_POWER;
+  if (a.mode != b.mode) fields |= FIELD_MODE;
+  if (a.temperature != b.temperature) fields |= FIELD_TEMPERATURE;
+  if (a.fan != b.fan) fields |= FIELD_FAN;
+  if (a.vane != b.vane) fields |= FIELD_VANE;
+  if (a.wideVane != b.wideVane) fields |= FIELD_WIDEVANE;
+  return fields;
+}
+
+void HeatPump::copySettingsFields(Settings &to, const Settings &from, byte fields)
+{
+  if (fields & FIELD_POWER) to.power = from.power;
+  if (fields & FIELD_MODE) to.mode = from.mode;
+  if (fields & FIELD_TEMPERATURE) to.temperature = from.temperature;
+  if (fields & FIELD_FAN) to.fan = from.fan;
+  if (fields & FIELD_VANE) to.vane = from.vane;
+  if (fields & FIELD_WIDEVANE) to.wideVane = from.wideVane;
+  to.iSee = from.iSee;
+}
+
+bool HeatPump::coalesceWindowElapsed()
+{
+  if (!wantedChangePending)
   {
-    if (byteMap[i] == byteValue)
-    {
-      return valuesMap[i];
-    }
+    return true;
   }
-  return valuesMap[0];
+  unsigned long now = millis();
+  return now - lastWantedChange >= coalesceWindowMs ||
+         now - firstWantedChange >= coalesceWindowMs * COALESCE_MAX_WINDOWS;
 }
 
-int HeatPump::lookupByteMapValue(const int valuesMap[], const byte byteMap[], int len, byte byteValue)
+bool HeatPump::isAwaitingReply()
 {
-  for (int i = 0; i < len; i++)
+  return awaitingReply();
+}
+
+bool HeatPump::awaitingReply()
+{
+  return awaitedReplyHeader != 0 && millis() - lastSend < responseWaitMs;
+}
+
+// Note a request that got no reply within the timeout, once per request. Called by sync() after readPacket().
+void HeatPump::checkReplyTimeout()
+{
+  if (awaitedReplyHeader == 0 || replyTimeoutSeen || awaitingReply())
+  {
+    return;
+  }
+  replyTimeoutSeen = true;
+  busStats.replyTimeouts++;
+
+  if (powerSettleProbe)
+  {
+    learnPowerSettle(false);
+  }
+  if (probeStep < 0 && timing.samples >= TIMING_MIN_SAMPLES)
+  {
+    // widen the timeout, a late reply will pull the average up as well
+    timing.replyDevMs = clampMs(timing.replyDevMs + timing.replyDevMs / 2 + 10, 0, RESPONSE_WAIT_MAX_MS);
+    updateResponseWait();
+  }
+}
+
+// Smoothed latency and deviation, the reply timeout is latency + 4 * deviation (plus a margin) like a TCP retransmit timer.
+void HeatPump::learnReplyLatency(unsigned long latency)
+{
+  if (latency > RESPONSE_WAIT_MAX_MS * 2)
+  {
+    return; // a reply to a request we have given up on long ago
+  }
+
+  if (timing.samples == 0)
+  {
+    timing.replyMs = latency;
+    timing.replyDevMs = latency / 2;
+  }
+  else
+  {
+    long error = (long)latency - timing.replyMs;
+    timing.replyMs += error / 8;
+    timing.replyDevMs += ((error < 0 ? -error : error) - (long)timing.replyDevMs) / 4;
+  }
+  if (timing.samples < 0xFFFF)
+  {
+    timing.samples++;
+  }
+  updateResponseWait();
+}
+
+// The first info request after a power change tells whether the pause was long enough:
+// shorten it a little each time the unit answers, lengthen it by half when it does not.
+void HeatPump::learnPowerSettle(bool settled)
+{
+  powerSettleProbe = false;
+  unsigned long settle = timing.powerSettleMs;
+  settle = settled ? settle - settle / 8 : settle + settle / 2;
+  timing.powerSettleMs = clampMs(settle, POWER_SETTLE_MIN_MS, POWER_SETTLE_MAX_MS);
+}
+
+// sample is when the settings request that first showed the acknowledged values was sent, relative to the ack.
+// Shrink slowly while the first read back already has them, move half way to the sample when it did not.
+void HeatPump::learnSettle(unsigned long sample, bool firstReadback)
+{
+  long settle = timing.settleMs;
+  settle = firstReadback ? settle - settle / 8 : settle + ((long)sample - settle) / 2;
+  timing.settleMs = clampMs(settle < 0 ? 0 : settle, 0, SETTLE_MAX_MS);
+}
+
+void HeatPump::updateResponseWait()
+{
+  if (timing.samples < TIMING_MIN_SAMPLES)
+  {
+    responseWaitMs = PACKET_RESPONSE_WAIT_TIME;
+    return;
+  }
+  unsigned long wait = timing.replyMs + 4UL * timing.replyDevMs + PACKET_GAP_MS; // margin for a slow sync() loop
+  responseWaitMs = clampMs(wait, RESPONSE_WAIT_MIN_MS, RESPONSE_WAIT_MAX_MS);
+}
+
+// Queue a complete packet (with checksum) to be sent by sync(). Returns false when the queue is full.
+bool HeatPump::queueCommand(byte *packet, int length, byte priority, heatpumpCommandCallback done)
+{
+  if (commandQueueCount >= COMMAND_QUEUE_LEN || length > PACKET_LEN)
+  {
+    return false;
+  }
+
+  queuedCommand &command = commandQueue[commandQueueCount++];
+  memcpy(command.packet, packet, length);
+  command.length = length;
+  command.priority = priority;
+  command.queuedAt = millis();
+  command.done = done;
+  return true;
+}
+
+// Resolve the command in flight and drop commands that waited too long. Called by sync() after readPacket().
+void HeatPump::processCommandQueue()
+{
+  if (commandInFlight)
   {
-    if (byteMap[i] == byteValue)
+    if (commandReplied)
+    {
+      finishCommand(inFlightCommand, CMD_RESULT_OK);
+    }
+    else if (!awaitingReply())
     {
-      return valuesMap[i];
+      finishCommand(inFlightCommand, CMD_RESULT_TIMEOUT);
     }
   }
-  return valuesMap[0];
-}
 
-bool HeatPump::canSend(bool isInfo)
+  for (int i = 0; i < commandQueueCount;)
+  {
+    if (millis() - commandQueue[i].queuedAt > COMMAND_QUEUE_TIMEOUT_MS)
+    {
+      queuedCommand expired = commandQueue[i];
+      removeQueuedCommand(i);
+      finishCommand(expired, CMD_RESULT_EXPIRED);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
 
+// Send the oldest command of the highest priority, if the bus is free for it.
+void HeatPump::sendQueuedCommand()
 {
-  // return (millis() - (isInfo ? PACKET_INFO_INTERVAL_MS : PACKET_SENT_INTERVAL_MS)) > lastSend;
+  if (commandInFlight || commandQueueCount == 0)
+  {
+    return;
+  }
 
-  if (isInfo)
+  int next = 0;
+  for (int i = 1; i < commandQueueCount; i++)
   {
-     if (powerSettingUpdate  && millis() - lastSendUpdate < PACKET_SENT_INTERVAL_MS + 10000 ){
-    //  if ( millis() - lastSendUpdate < 10000 ){
-        return false;
-     }
-    // return millis() - lastSend > PACKET_INFO_INTERVAL_MS;
-    return millis() - lastSend > PACKET_INFO_INTERVAL_MS;
+    if (commandQueue[i].priority > commandQueue[next].priority)
+    {
+      next = i;
+    }
   }
-  else
+
+  if (!canSend(commandQueue[next].packet[1] == pgm_read_byte(&INFOHEADER[1])))
   {
-    return millis() - lastSendUpdate > packet_sent_delay_interval_ms && millis() - lastSend > PACKET_INFO_INTERVAL_MS;
+    return;
+  }
 
+  inFlightCommand = commandQueue[next];
+  removeQueuedCommand(next);
+
+  commandInFlight = true;
+  commandReplied = false;
+  writePacket(inFlightCommand.packet, inFlightCommand.length);
+}
+
+void HeatPump::removeQueuedCommand(int index)
+{
+  for (int i = index; i < commandQueueCount - 1; i++)
+  {
+    commandQueue[i] = commandQueue[i + 1];
   }
+  commandQueueCount--;
+  commandQueue[commandQueueCount].done = nullptr; // release whatever the callback captured
 }
 
-bool HeatPump::canRead()
+void HeatPump::finishCommand(queuedCommand &command, int result)
 {
-  // return (waitForRead && (millis() - PACKET_SENT_INTERVAL_MS) > lastSend);
-  // return (waitForRead && (millis() - PACKET_RESPONSE_WAIT_TIME) > lastSend);
-  return (millis() - PACKET_RESPONSE_WAIT_TIME) > lastSend;
+  if (&command == &inFlightCommand)
+  {
+    commandInFlight = false;
+  }
+  // keep the functions cache in step with the A/C, see setFunctions()
+  byte type = command.packet[1];
+  byte request = command.packet[5];
+  if (type == pgm_read_byte(&HEADER[1]) && (request == FUNCTIONS_SET_PART1 || request == FUNCTIONS_SET_PART2))
+  {
+    if (result == CMD_RESULT_OK)
+    {
+      byte cached[FUNCTIONS_HALF_LEN];
+      if (request == FUNCTIONS_SET_PART1)
+      {
+        functions.getData1(cached);
+        functions.setData1(&command.packet[6]);
+      }
+      else
+      {
+        functions.getData2(cached);
+        functions.setData2(&command.packet[6]);
+      }
+      markState(0, memcmp(cached, &command.packet[6], FUNCTIONS_HALF_LEN) != 0 ? STATE_FUNCTIONS : 0);
+    }
+    else
+    {
+      functionsStale = true; // the A/C may or may not have applied it
+    }
+  }
+  else if (type == pgm_read_byte(&INFOHEADER[1]) && request == FUNCTIONS_GET_PART2)
+  {
+    functionsFetching = false;
+  }
+  else if (type == pgm_read_byte(&HEADER[1]) && request == REMOTE_TEMP_SET)
+  {
+    remoteTempQueued = false; // a failed one is tried again after remoteTempMinIntervalMs
+    if (result == CMD_RESULT_OK)
+    {
+      remoteTempSent = command.packet[6] ? (command.packet[8] - 128) / 2.0 : 0;
+      remoteTempSentAt = millis();
+    }
+  }
+
+  heatpumpCommandCallback done = command.done;
+  command.done = nullptr;
+  if (done)
+  {
+    done(result); // may queue the next command
+  }
 }
 
-byte HeatPump::checkSum(byte bytes[], int len)
+byte HeatPump::checkSum(const byte bytes[], int len)
 {
   byte sum = 0;
   for (int i = 0; i < len; i++)
@@ -686,103 +1768,155 @@ byte HeatPump::checkSum(byte bytes[], int len)
 }
 
 
-static void readHPsettings(heatpumpSettings hpSettings)
+void HeatPump::createPacket(byte *packet, const Settings &settings, byte fields)
+{
+  prepareSetPacket(packet, PACKET_LEN);
+
+  if (fields & FIELD_POWER)
+  {
+    packet[8] = POWER_BYTES[(int)settings.power];
+    packet[6] += CONTROL_PACKET_1[0];
+  }
+
+  if (fields & FIELD_MODE)
+  {
+    packet[9] = MODE_BYTES[(int)settings.mode];
+    packet[6] += CONTROL_PACKET_1[1];
+  }
+  if (!tempMode && (fields & FIELD_TEMPERATURE))
+  {
+    packet[10] = TEMP_HALF_DEG_MAX / 2 - settings.temperature / 2; // 0x00 = 31, 0x0f = 16
+    packet[6] += CONTROL_PACKET_1[2];
+  }
+  else if (tempMode && (fields & FIELD_TEMPERATURE))
+  {
+    packet[19] = settings.temperature + 128;
+    packet[6] += CONTROL_PACKET_1[2];
+  }
+  if (fields & FIELD_FAN)
+  {
+    packet[11] = FAN_BYTES[(int)settings.fan];
+    packet[6] += CONTROL_PACKET_1[3];
+  }
+  if (fields & FIELD_VANE)
+  {
+    packet[12] = VANE_BYTES[(int)settings.vane];
+    packet[6] += CONTROL_PACKET_1[4];
+  }
+  if (fields & FIELD_WIDEVANE)
+  {
+    packet[18] = WIDEVANE_BYTES[(int)settings.wideVane] | (wideVaneAdj ? 0x80 : 0x00);
+    packet[7] += CONTROL_PACKET_2[0];
+  }
+  // add the checksum
+  byte chkSum = checkSum(packet, 21);
+  packet[21] = chkSum;
+}
+
+void HeatPump::setInfoModeIndex(int index)
+{
+  if (index >= 0 && index < INFOMODE_LEN)
+  {
+    pollState[index].due = true;
+  }
+}
+
+int HeatPump::findInfoIndex(byte command)
+{
+  for (int i = 0; i < INFOMODE_LEN; i++)
+  {
+    if (INFOMODE[i].command == command)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Pick the info request whose value is the most overdue relative to its learned target, weighted by priority.
+// Returns -1 when nothing is old enough to be worth the bus time yet.
+int HeatPump::selectInfoIndex(byte packetType)
 {
+  if (packetType < INFOMODE_LEN)
+  {
+    return packetType;
+  }
+  if (packetType == PACKET_TYPE_NO_POLL)
+  {
+    return -1;
+  }
+
+  unsigned long now = millis();
+  int best = -1;
+  float bestScore = 0;
+  for (int i = 0; i < INFOMODE_LEN; i++)
+  {
+    if (i != RQST_PKT_SETTINGS && (capabilities & CAP_PROBED) && !(capabilities & capabilityForCommand(INFOMODE[i].command)))
+    {
+      continue; // the unit never answered this request, don't spend a reply timeout on it
+    }
+
+    unsigned long age = now - pollState[i].lastPolled;
+    unsigned long target = (long)(now - pollState[i].boostUntil) < 0 ? INFOMODE[i].minIntervalMs : pollState[i].targetMs;
+
+    if (!pollState[i].due && age < target)
+    {
+      continue;
+    }
 
-  #if !defined(CDC_DISABLED) && defined(__WIFIKITSAMD__)
-  SerialUSB.println("\tPower: " + String(hpSettings.power));
-  SerialUSB.println("\tMode: " + String(hpSettings.mode));
-  float degc = hpSettings.temperature;
-  SerialUSB.println("\tTarget: " + String(degc, 1));
-  SerialUSB.println("\tFan: " + String(hpSettings.fan));
-  SerialUSB.println("\tSwing: H:" + String(hpSettings.wideVane) + " V:" + String(hpSettings.vane));
-  #endif
+    float score = (float)INFOMODE[i].priority * age / target;
+    if (pollState[i].due)
+    {
+      score += 1000; // explicit requests go first
+    }
+    if (best < 0 || score > bestScore)
+    {
+      best = i;
+      bestScore = score;
+    }
+  }
+  return best;
 }
 
-void HeatPump::createPacket(byte *packet, heatpumpSettings settings)
+// Learn how fast a value changes: poll twice as often after a change, back off slowly while it stays the same.
+void HeatPump::pollReplyReceived(byte command, bool changed)
 {
-  prepareSetPacket(packet, PACKET_LEN);
-  // SerialUSB.println("Local Settings");
-  readHPsettings(currentSettings);
-  // SerialUSB.println("Send Settings");
-  readHPsettings(settings);
-
-  if (settings.power != currentSettings.power)
+  int index = findInfoIndex(command);
+  if (index < 0)
   {
-    packet[8] = POWER[lookupByteMapIndex(POWER_MAP, 2, settings.power)];
-    packet[6] += CONTROL_PACKET_1[0];
+    return;
   }
 
-  if (settings.mode != currentSettings.mode)
-  {
-    packet[9] = MODE[lookupByteMapIndex(MODE_MAP, 5, settings.mode)];
-    packet[6] += CONTROL_PACKET_1[1];
-  }
-  if (!tempMode && settings.temperature != currentSettings.temperature)
-  {
-    packet[10] = TEMP[lookupByteMapIndex(TEMP_MAP, 16, settings.temperature)];
-    packet[6] += CONTROL_PACKET_1[2];
-  }
-  else if (tempMode && settings.temperature != currentSettings.temperature)
-  {
-    float temp = (settings.temperature * 2) + 128;
-    packet[19] = (int)temp;
-    packet[6] += CONTROL_PACKET_1[2];
-  }
-  if (settings.fan != currentSettings.fan)
-  {
-    packet[11] = FAN[lookupByteMapIndex(FAN_MAP, 6, settings.fan)];
-    packet[6] += CONTROL_PACKET_1[3];
-  }
-  if (settings.vane != currentSettings.vane)
+  PollSlotState &state = pollState[index];
+  if (changed)
   {
-    packet[12] = VANE[lookupByteMapIndex(VANE_MAP, 7, settings.vane)];
-    packet[6] += CONTROL_PACKET_1[4];
+    state.targetMs = max(INFOMODE[index].minIntervalMs, state.targetMs / 2);
   }
-  if (settings.wideVane != currentSettings.wideVane)
+  else
   {
-    packet[18] = WIDEVANE[lookupByteMapIndex(WIDEVANE_MAP, 7, settings.wideVane)] | (wideVaneAdj ? 0x80 : 0x00);
-    packet[7] += CONTROL_PACKET_2[0];
+    state.targetMs = min(INFOMODE[index].maxIntervalMs, state.targetMs + state.targetMs / 8);
   }
-  // add the checksum
-  byte chkSum = checkSum(packet, 21);
-  packet[21] = chkSum;
 }
 
-void HeatPump::setInfoModeIndex(int index)
+void HeatPump::boostPoll(byte command)
 {
-  if (index < INFOMODE_LEN)
+  int index = findInfoIndex(command);
+  if (index >= 0)
   {
-    infoMode = index;
+    pollState[index].targetMs = INFOMODE[index].minIntervalMs;
+    pollState[index].boostUntil = millis() + POLL_BOOST_MS;
   }
 }
 
-void HeatPump::createInfoPacket(byte *packet, byte packetType)
+void HeatPump::createInfoPacket(byte *packet, int index)
 {
   // add the header to the packet
-  for (int i = 0; i < INFOHEADER_LEN; i++)
-  {
-    packet[i] = INFOHEADER[i];
-  }
+  memcpy_P(packet, INFOHEADER, INFOHEADER_LEN);
 
-  // set the mode - settings or room temperature
-  if (packetType != PACKET_TYPE_DEFAULT)
-  {
-    packet[5] = INFOMODE[packetType];
-  }
-  else
-  {
-    // request current infoMode, and increment for the next request
-    packet[5] = INFOMODE[infoMode];
-    if (infoMode == (INFOMODE_LEN - 1))
-    {
-      infoMode = 0;
-    }
-    else
-    {
-      infoMode++;
-    }
-  }
+  // set the mode - settings, room temperature, timers or status
+  packet[5] = INFOMODE[index].command;
+  pollState[index].lastPolled = millis();
+  pollState[index].due = false;
 
   // packet[5] = infomodecmd++ ; //FOR DEBUG
 
@@ -799,378 +1933,551 @@ void HeatPump::createInfoPacket(byte *packet, byte packetType)
 
 void HeatPump::writePacket(byte *packet, int length)
 {
-
-#ifdef ESP32
-  Serial.println("CN105 >> " + getHEXformatted(packet, length));
-#elif __WIFIKITSAMD__ 
-  #ifndef CDC_DISABLED
-  SerialUSB.println("CN105 >> " + getHEXformatted(packet, length));
-  #endif
+  transport->write(packet, length);
+#if HEATPUMP_TRACE_FRAMES > 0
+  traceFrame(TRACE_SENT, packet, length);
 #endif
 
-  for (int i = 0; i < length; i++)
-  {
-    _HardSerial->write((uint8_t)packet[i]);
-  }
-
   if (packetCallback)
   {
     packetCallback(packet, length, (char *)"packetSent");
   }
   // waitForRead = true;
   lastSend = millis();
+  replyTimeoutSeen = false;
+
+  busStats.framesSent++;
+  if (length > 1 && packet[1] == 0x41)
+  {
+    busStats.controlSent++;
+  }
+  busStatsSlot = length > 1 ? findBusStatsSlot(packet[1], length > 5 ? packet[5] : 0) : -1;
+  if (busStatsSlot >= 0)
+  {
+    busStats.commands[busStatsSlot].sent++;
+  }
+  if (powerSettleCheck && length > 1 && packet[1] == 0x42)
+  {
+    powerSettleCheck = false;
+    powerSettleProbe = true;
+  }
+
+  // every CN105 reply type is the request type + 0x20 (0x5a -> 0x7a, 0x41 -> 0x61, 0x42 -> 0x62)
+  awaitedReplyHeader = length > 1 ? packet[1] + 0x20 : 0;
+  awaitedReplyCommand = length > 5 ? packet[5] : 0;
 
   // readPacket();
 }
 
 int HeatPump::readPacket(bool waitForPacket)
 {
-  byte header[INFOHEADER_LEN] = {};
-  byte data[PACKET_LEN] = {};
-  int dataSum = 0;
-  byte checksum = 0;
-  byte dataLength = 0;
+  int packetType = RCVD_PKT_FAIL;
   unsigned long startTime = millis();
-  uint8_t len = 0;
-  bool receiveSuccess = false;
 
-
-  //Has incoming message in buffer.
-  if (_HardSerial->available() > 0 || waitForPacket)
+  do
   {
-    while (millis() - startTime < PACKET_RESPONSE_WAIT_TIME)
+    // drop the sync byte of a partial frame whose remaining bytes never arrived and hunt for the next one
+    if (rxLen > 0 && millis() - rxStartTime > PACKET_RESPONSE_WAIT_TIME)
     {
-      if (_HardSerial->available() > 0)
-      {
-        char c = _HardSerial->read();
+#ifdef ESP32
+      Serial.println("Wait read timeout");
+#elif __WIFIKITSAMD__
+      #ifndef CDC_DISABLED
+      SerialUSB.println("Wait read timeout");
+      #endif
+#endif
+      busStats.readTimeouts++;
+      discardReceived(1);
+    }
 
-        // Check packet
-        if (len < 4 && len != 1)
-        {
-          if (c != HEADER[len])
-          {
-            // Serial.println("Header invalid");
-            _HardSerial->flush();
-            return RCVD_PKT_FAIL;
-          }
-        }
-        if (len == 4)
-        {
-          dataLength = c;
-        }
+    // only consume what is already in the UART buffer, the rest of a frame is picked up on the next call.
+    // Every complete frame waiting in the buffer is decoded in this pass.
+    while (transport->available() > 0)
+    {
+      if (rxLen == 0)
+      {
+        rxStartTime = millis();
+      }
+      rxBuffer[rxLen++] = transport->read();
 
-        // Store packet
-        if (len <= 4)
+      int frameLen = findFrame();
+      if (frameLen > 0)
+      {
+        int receivedType = processPacket();
+        discardReceived(frameLen);
+        if (receivedType != RCVD_PKT_FAIL)
         {
-          header[len] = c;
-        }
-        else
-        { // Data bytes + checksum byte
-          // Serial.printf("Data elem %d, %x\n", len-5, c);
-          data[len - 5] = c;
+          packetType = receivedType;
         }
+      }
+    }
+  } while (waitForPacket && packetType == RCVD_PKT_FAIL && millis() - startTime < PACKET_RESPONSE_WAIT_TIME);
 
-        // End condition
-        if (len == dataLength + 5)
-        {
-          receiveSuccess = true;
-          len++;
-          break;
-        }
+  return packetType; // type of the last frame decoded, RCVD_PKT_FAIL if there was none
+}
 
-        len++;
-      }
+int HeatPump::findFrame()
+{
+  // Returns the length of a complete, valid frame at the start of rxBuffer, or 0 if more bytes are needed.
+  // Bytes that cannot start a valid frame are dropped one at a time, so the parser resynchronises on
+  // the next sync byte after line noise, a truncated frame or a checksum error.
+  while (rxLen > 0)
+  {
+    int frameLen = checkFrame(rxBuffer, rxLen);
+    if (frameLen == FRAME_BAD_HEADER)
+    {
+      busStats.headerRejects++;
     }
-  }else{
-    return RCVD_PKT_FAIL; //No response
+    else if (frameLen == FRAME_BAD_CHECKSUM)
+    {
+      busStats.checksumErrors++;
+    }
+    else
+    {
+      return frameLen;
+    }
+    discardReceived(1);
   }
+  return 0;
+}
 
+int HeatPump::checkFrame(const byte *buffer, int length)
+{
+  if (length < 1)
+  {
+    return FRAME_INCOMPLETE;
+  }
+  if (buffer[0] != pgm_read_byte(&HEADER[0]) ||
+      (length > 2 && buffer[2] != pgm_read_byte(&HEADER[2])) ||
+      (length > 3 && buffer[3] != pgm_read_byte(&HEADER[3])) ||
+      (length > 4 && buffer[4] > MAX_DATA_LEN))
+  {
+    return FRAME_BAD_HEADER;
+  }
 
-  _HardSerial->flush();
-  if (!receiveSuccess)
+  if (length < INFOHEADER_LEN)
   {
-#ifdef ESP32
-    Serial.println("Wait read timeout");
-#elif __WIFIKITSAMD__
-    #ifndef CDC_DISABLED
-    SerialUSB.println("Wait read timeout");
-    #endif
-#endif
-    return RCVD_PKT_FAIL;
+    return FRAME_INCOMPLETE;
   }
 
-  // sum up the header bytes...
-  for (int i = 0; i < INFOHEADER_LEN; i++)
+  int frameLen = INFOHEADER_LEN + buffer[4] + 1; // header + data + checksum
+  if (length < frameLen)
   {
-    dataSum += header[i];
+    return FRAME_INCOMPLETE;
   }
 
-  // ...and add to that the sum of the data bytes
-  for (int i = 0; i < dataLength; i++)
+  if (checkSum(buffer, frameLen - 1) != buffer[frameLen - 1])
   {
-    dataSum += data[i];
+    return FRAME_BAD_CHECKSUM;
   }
+  return frameLen;
+}
 
-#ifdef ESP32
-  Serial.println("CN105 << " + getHEXformatted(header, INFOHEADER_LEN) + "|" + getHEXformatted(data, dataLength + 1));
-#elif __WIFIKITSAMD__
-  #ifndef CDC_DISABLED
-  SerialUSB.println("CN105 << " + getHEXformatted(header, INFOHEADER_LEN) + "|" + getHEXformatted(data, dataLength + 1));
-  #endif
-#endif
+void HeatPump::discardReceived(int count)
+{
+  if (count >= rxLen)
+  {
+    rxLen = 0;
+    return;
+  }
+  memmove(rxBuffer, rxBuffer + count, rxLen - count);
+  rxLen -= count;
+  rxStartTime = millis();
+}
+
+int HeatPump::processPacket()
+{
+  byte *header = rxBuffer;
+  byte *data = rxBuffer + INFOHEADER_LEN;
+  byte dataLength = rxBuffer[4];
 
-  // calculate checksum
-  checksum = (0xfc - dataSum) & 0xff;
+#if HEATPUMP_TRACE_FRAMES > 0
+  traceFrame(TRACE_RECEIVED, rxBuffer, INFOHEADER_LEN + dataLength + 1);
+#endif
+  lastRecv = millis();
+  busStats.framesReceived++;
 
-  if (data[dataLength] == checksum)
+  // match the reply to the outstanding request, info replies must also echo the requested command byte
+  if (awaitedReplyHeader != 0 && header[1] == awaitedReplyHeader &&
+      (header[1] != 0x62 || data[0] == awaitedReplyCommand))
   {
-    lastRecv = millis();
-    if (packetCallback)
+    awaitedReplyHeader = 0;
+    lastReply = lastRecv;
+    learnReplyLatency(lastReply - lastSend);
+    if (header[1] == 0x61)
     {
-      byte packet[37]; // we are going to put header[5] and data[32] into this, so the whole packet is sent to the callback
-      for (int i = 0; i < INFOHEADER_LEN; i++)
+      busStats.controlAcked++;
+    }
+    if (busStatsSlot >= 0)
+    {
+      CommandStats &slot = busStats.commands[busStatsSlot];
+      int bucket = 0;
+      while (bucket < LATENCY_BUCKETS - 1 && lastReply - lastSend >= LATENCY_BUCKET_MS[bucket])
       {
-        packet[i] = header[i];
+        bucket++;
       }
-      for (int i = 0; i < (dataLength + 1); i++)
-      { // must be dataLength+1 to pick up checksum byte
-        packet[(i + 5)] = data[i];
+      slot.replied++;
+      if (slot.latency[bucket] < 0xFFFF)
+      {
+        slot.latency[bucket]++;
       }
-      packetCallback(packet, PACKET_LEN, (char *)"packetRecv");
     }
-
+    commandReplied = commandInFlight;
     if (header[1] == 0x62)
     {
+      capabilities |= capabilityForCommand(data[0]);
+      if (powerSettleProbe)
+      {
+        learnPowerSettle(true);
+      }
+    }
+    if (header[1] == 0x61 && updating && !commandInFlight)
+    {
+      updateAcked = true;
+    }
+  }
 
-      // uint8_t command = data[0];
-      // static std::map<uint8_t, String> mp;
-      // String lastData = "";
-      // String currentData  = getHEXformatted(data, dataLength);
-      // bool changed = false;
-      // if(mp.find(command) != mp.end()){
-      //   lastData  = mp.find(command)->second;
-      //   // Serial.print("Command " );
-      //   // Serial.println(command,HEX);
-      //   // Serial.println("Current" + currentData);
-      //   // Serial.println("Last" + lastData);
-      //   if (currentData != lastData){
-      //     changed = true;
-      //   }
-      // }
-      // mp[command] = currentData;
-      //   Serial.print(changed?"[Changed]\n":"\n");
-      //   if (changed){
-      //     Serial.println("OLDAT << " + getHEXformatted(header, INFOHEADER_LEN) + "|" + lastData);
-      //   }
-      //   Serial.println();
-
-      switch (data[0])
+  if (packetCallback)
+  {
+    byte packet[INFOHEADER_LEN + MAX_DATA_LEN + 1]; // we are going to put header[5] and data[32] + checksum into this, so the whole packet is sent to the callback
+    for (int i = 0; i < INFOHEADER_LEN; i++)
+    {
+      packet[i] = header[i];
+    }
+    for (int i = 0; i < (dataLength + 1); i++)
+    { // must be dataLength+1 to pick up checksum byte
+      packet[(i + 5)] = data[i];
+    }
+    packetCallback(packet, PACKET_LEN, (char *)"packetRecv");
+  }
+
+  if (header[1] == 0x62)
+  {
+    // most polls return the same bytes as last time, only note that they arrived. While a change is settling the
+    // settings reply is decoded anyway, an unchanged one is what tells that the A/C has not applied it yet.
+    int reg = findRegister(data[0]);
+    if (reg >= 0 && dataLength > REGISTER_LEN)
+    {
+      bool unchanged = (registersValid & (1 << reg)) && memcmp(registers[reg], &data[1], REGISTER_LEN) == 0;
+      memcpy(registers[reg], &data[1], REGISTER_LEN);
+      registersValid |= 1 << reg;
+      if (unchanged && !(data[0] == 0x02 && settleFields))
       {
-      case 0x02:
-      { // setting information
-        heatpumpSettings receivedSettings;
-        receivedSettings.power = lookupByteMapValue(POWER_MAP, POWER, 2, data[3]);
-        receivedSettings.iSee = data[4] > 0x08 ? true : false;
-        receivedSettings.mode = lookupByteMapValue(MODE_MAP, MODE, 5, receivedSettings.iSee ? (data[4] - 0x08) : data[4]);
-
-        if (data[11] != 0x00)
-        {
-          int temp = data[11];
-          temp -= 128;
-          receivedSettings.temperature = (float)temp / 2;
-          tempMode = true;
-        }
-        else
-        {
-          receivedSettings.temperature = lookupByteMapValue(TEMP_MAP, TEMP, 16, data[5]);
-        }
+        return unchangedReply(data[0]);
+      }
+    }
+
+    switch (data[0])
+    {
+    case 0x02:
+    { // setting information
+      Settings receivedSettings;
+      receivedSettings.power = enumFromByte<Power>(POWER_BYTES, data[3]);
+      receivedSettings.iSee = data[4] > 0x08 ? true : false;
+      receivedSettings.mode = enumFromByte<Mode>(MODE_BYTES, receivedSettings.iSee ? (data[4] - 0x08) : data[4]);
+
+      if (data[11] != 0x00)
+      {
+        receivedSettings.temperature = data[11] - 128; // already in half degrees
+        tempMode = true;
+        capabilities |= CAP_HALF_DEGREE;
+      }
+      else
+      {
+        receivedSettings.temperature = data[5] <= 0x0f ? TEMP_HALF_DEG_MAX - data[5] * 2 : TEMP_HALF_DEG_MAX;
+      }
 
-        receivedSettings.fan = lookupByteMapValue(FAN_MAP, FAN, 6, data[6]);
-        receivedSettings.vane = lookupByteMapValue(VANE_MAP, VANE, 7, data[7]);
-        receivedSettings.wideVane = lookupByteMapValue(WIDEVANE_MAP, WIDEVANE, 7, data[10] & 0x0F);
-        wideVaneAdj = (data[10] & 0xF0) == 0x80 ? true : false;
+      receivedSettings.fan = enumFromByte<Fan>(FAN_BYTES, data[6]);
+      receivedSettings.vane = enumFromByte<Vane>(VANE_BYTES, data[7]);
+      receivedSettings.wideVane = enumFromByte<WideVane>(WIDEVANE_BYTES, data[10] & 0x0F);
+      wideVaneAdj = (data[10] & 0xF0) == 0x80 ? true : false;
+      if ((data[10] & 0x0F) != 0)
+      {
+        capabilities |= CAP_WIDE_VANE;
+      }
+      if (receivedSettings.iSee)
+      {
+        capabilities |= CAP_ISEE;
+      }
 
-        if (settingsChangedCallback && receivedSettings != currentSettings)
+      if (settleFields)
+      {
+        if (!(diffSettings(receivedSettings, sentSettings) & settleFields))
+        {
+          learnSettle(lastSend - settleAckAt, settleReadbacks == 0);
+          settleFields = 0;
+        }
+        else if (millis() - settleAckAt < SETTLE_MAX_MS)
         {
-          currentSettings = receivedSettings;
-          settingsChangedCallback();
+          // not applied yet, look again shortly to find out how long this unit takes
+          settleReadbacks++;
+          readbackPending = true;
+          readbackAt = millis() + SETTLE_RETRY_MS;
         }
         else
         {
-          currentSettings = receivedSettings;
+          settleFields = 0; // the A/C changed something else, nothing to learn
         }
+      }
+
+      bool changed = !settingsReceived || receivedSettings != currentSettings;
+      markState(STATE_SETTINGS, diffSettings(receivedSettings, currentSettings) |
+                                (receivedSettings.iSee != currentSettings.iSee ? STATE_ISEE : 0));
+      pollReplyReceived(data[0], changed);
+      if (changed && !updating && settingsReceived)
+      {
+        // changed by the IR remote or another controller, the user is probably still adjusting it
+        boostPoll(data[0]);
+      }
+
+      currentSettings = receivedSettings;
+      settingsReceived = true;
+      if (changed)
+      {
+        queueEvent(EVENT_SETTINGS);
+      }
 
-        // // if this is the first time we have synced with the heatpump, set wantedSettings to receivedSettings
-        // if (firstRun || (autoUpdate && externalUpdate))
-        // {
-        //   wantedSettings = currentSettings;
-        //   firstRun = false;
-        // }
+      // // if this is the first time we have synced with the heatpump, set wantedSettings to receivedSettings
+      // if (firstRun || (autoUpdate && externalUpdate))
+      // {
+      //   wantedSettings = currentSettings;
+      //   firstRun = false;
+      // }
+
+      // fields nobody is changing follow the A/C. Pending and in-flight fields keep the value that was asked for,
+      // a reply polled before the ack must not undo them; a pending field the A/C already has needs no packet.
+      copySettingsFields(wantedSettings, currentSettings, ~(pendingFields | inFlightFields) & FIELD_ALL);
+      pendingFields &= diffSettings(wantedSettings, currentSettings);
+
+      return RCVD_PKT_SETTINGS;
+    }
 
-        wantedSettings = currentSettings;
+    case 0x03:
+    { // Room temperature reading
+      heatpumpStatus receivedStatus;
+      // Serial.printf("Mystery val 1 : %d\n",data[13]);
 
-        return RCVD_PKT_SETTINGS;
+      if (data[6] != 0x00)
+      {
+        int temp = data[6];
+        temp -= 128;
+        receivedStatus.roomTemperature = (float)temp / 2;
+      }
+      else
+      {
+        receivedStatus.roomTemperature = ROOM_TEMP_MIN + (data[3] < ROOM_TEMP_LEN ? data[3] : 0);
       }
 
-      case 0x03:
-      { // Room temperature reading
-        heatpumpStatus receivedStatus;
-        // Serial.printf("Mystery val 1 : %d\n",data[13]);
+      bool changed = currentStatus.roomTemperature != receivedStatus.roomTemperature;
+      markState(STATE_ROOM_TEMP, changed ? STATE_ROOM_TEMP : 0);
+      pollReplyReceived(data[0], changed);
 
-        if (data[6] != 0x00)
-        {
-          int temp = data[6];
-          temp -= 128;
-          receivedStatus.roomTemperature = (float)temp / 2;
-        }
-        else
-        {
-          receivedStatus.roomTemperature = lookupByteMapValue(ROOM_TEMP_MAP, ROOM_TEMP, 32, data[3]);
-        }
+      currentStatus.roomTemperature = receivedStatus.roomTemperature;
+      if (changed)
+      {
+        queueEvent(EVENT_STATUS);
+        queueEvent(EVENT_ROOM_TEMP); // this should be deprecated - EVENT_STATUS covers it
+      }
 
-        if ((statusChangedCallback || roomTempChangedCallback) && currentStatus.roomTemperature != receivedStatus.roomTemperature)
-        {
-          currentStatus.roomTemperature = receivedStatus.roomTemperature;
+      return RCVD_PKT_ROOM_TEMP;
+    }
 
-          if (statusChangedCallback)
-          {
-            statusChangedCallback(currentStatus);
-          }
+    case 0x04:
+    { // unknown
+      break;
+    }
 
-          if (roomTempChangedCallback)
-          { // this should be deprecated - statusChangedCallback covers it
-            roomTempChangedCallback(currentStatus.roomTemperature);
-          }
-        }
-        else
-        {
-          currentStatus.roomTemperature = receivedStatus.roomTemperature;
-        }
+    case 0x05:
+    { // timer packet
+      heatpumpTimers receivedTimers;
 
-        return RCVD_PKT_ROOM_TEMP;
+      receivedTimers.mode = TIMER_MODE_MAP[data[3] < TIMER_MODE_LEN ? data[3] : 0];
+      receivedTimers.onMinutesSet = data[4] * TIMER_INCREMENT_MINUTES;
+      receivedTimers.onMinutesRemaining = data[6] * TIMER_INCREMENT_MINUTES;
+      receivedTimers.offMinutesSet = data[5] * TIMER_INCREMENT_MINUTES;
+      receivedTimers.offMinutesRemaining = data[7] * TIMER_INCREMENT_MINUTES;
+
+      bool changed = currentStatus.timers != receivedTimers;
+      markState(STATE_TIMERS, changed ? STATE_TIMERS : 0);
+      pollReplyReceived(data[0], changed);
+      if (receivedTimers.mode == TIMER_MODE_MAP[0])
+      {
+        // no timer set, it can only change through a command we see or the IR remote (caught by the settings poll)
+        pollState[RQST_PKT_TIMERS].targetMs = INFOMODE[RQST_PKT_TIMERS].maxIntervalMs;
       }
 
-      case 0x04:
-      { // unknown
-        break;
+      currentStatus.timers = receivedTimers;
+      if (changed)
+      {
+        queueEvent(EVENT_STATUS);
       }
 
-      case 0x05:
-      { // timer packet
-        heatpumpTimers receivedTimers;
+      return RCVD_PKT_TIMER;
+    }
 
-        receivedTimers.mode = lookupByteMapValue(TIMER_MODE_MAP, TIMER_MODE, 4, data[3]);
-        receivedTimers.onMinutesSet = data[4] * TIMER_INCREMENT_MINUTES;
-        receivedTimers.onMinutesRemaining = data[6] * TIMER_INCREMENT_MINUTES;
-        receivedTimers.offMinutesSet = data[5] * TIMER_INCREMENT_MINUTES;
-        receivedTimers.offMinutesRemaining = data[7] * TIMER_INCREMENT_MINUTES;
+    case 0x06:
+    { // status
+      heatpumpStatus receivedStatus;
+      receivedStatus.operating = data[4];
+      receivedStatus.compressorFrequency = data[3];
+      uint16_t power = data[5] << 8;
+      power += data[6];
+      receivedStatus.power = power;
+      // Serial.printf("Mystery val 2 : %d\n",mVal2);
+
+      uint16_t changedFields = 0;
+      if (currentStatus.operating != receivedStatus.operating) changedFields |= STATE_OPERATING;
+      if (currentStatus.compressorFrequency != receivedStatus.compressorFrequency) changedFields |= STATE_COMPRESSOR;
+      if (currentStatus.power != receivedStatus.power) changedFields |= STATE_POWER_USAGE;
+      markState(STATE_OPERATING | STATE_COMPRESSOR | STATE_POWER_USAGE, changedFields);
+      pollReplyReceived(data[0], changedFields != 0);
+
+      // status event -- not triggered for compressor frequency and power at the moment
+      bool operatingChanged = currentStatus.operating != receivedStatus.operating;
+      currentStatus.operating = receivedStatus.operating;
+      currentStatus.compressorFrequency = receivedStatus.compressorFrequency;
+      currentStatus.power = receivedStatus.power;
+      if (operatingChanged)
+      {
+        queueEvent(EVENT_STATUS);
+      }
 
-        // callback for status change
-        if (statusChangedCallback && currentStatus.timers != receivedTimers)
-        {
-          currentStatus.timers = receivedTimers;
-          statusChangedCallback(currentStatus);
-        }
-        else
-        {
-          currentStatus.timers = receivedTimers;
-        }
+      return RCVD_PKT_STATUS;
+    }
 
-        return RCVD_PKT_TIMER;
-      }
+    case 0x09:
+    { // standby mode maybe?
+      break;
+    }
 
-      case 0x06:
-      { // status
-        heatpumpStatus receivedStatus;
-        receivedStatus.operating = data[4];
-        receivedStatus.compressorFrequency = data[3];
-        uint16_t power = data[5] << 8;
-        power += data[6];
-        receivedStatus.power = power;
-        // Serial.printf("Mystery val 2 : %d\n",mVal2);
-
-        // callback for status change -- not triggered for compressor frequency at the moment
-        if (statusChangedCallback && currentStatus.operating != receivedStatus.operating)
+    case 0x20:
+    case 0x22:
+    {
+      if (dataLength == 0x10)
+      {
+        byte cached[FUNCTIONS_HALF_LEN];
+        if (data[0] == FUNCTIONS_GET_PART1)
         {
-          currentStatus.operating = receivedStatus.operating;
-          currentStatus.compressorFrequency = receivedStatus.compressorFrequency;
-          statusChangedCallback(currentStatus);
+          functions.getData1(cached);
+          functions.setData1(&data[1]);
         }
         else
         {
-          currentStatus.operating = receivedStatus.operating;
-          currentStatus.compressorFrequency = receivedStatus.compressorFrequency;
-          currentStatus.power = receivedStatus.power;
+          functions.getData2(cached);
+          functions.setData2(&data[1]);
         }
-
-        return RCVD_PKT_STATUS;
-      }
-
-      case 0x09:
-      { // standby mode maybe?
-        break;
-      }
-
-      case 0x20:
-      case 0x22:
-      {
-        if (dataLength == 0x10)
+        markState(STATE_FUNCTIONS, memcmp(cached, &data[1], FUNCTIONS_HALF_LEN) != 0 ? STATE_FUNCTIONS : 0);
+        if (data[0] == FUNCTIONS_GET_PART2 && functions.isValid())
         {
-          if (data[0] == 0x20)
-          {
-            functions.setData1(&data[1]);
-          }
-          else
-          {
-            functions.setData2(&data[1]);
-          }
-
-          return RCVD_PKT_FUNCTIONS;
+          functionsReadAt = millis();
+          functionsStale = false;
         }
-        break;
-      }
+
+        return RCVD_PKT_FUNCTIONS;
       }
+      break;
     }
-
-    if (header[1] == 0x61)
-    { // Last update was successful
-      updating = false;
-      return RCVD_PKT_UPDATE_SUCCESS;
     }
-    else if (header[1] == 0x7a)
-    { // Last update was successful
-      connected = true;
-      // return RCVD_PKT_CONNECT_SUCCESS;
-      return 1;
+  }
+
+  if (header[1] == 0x61)
+  { // Last update was successful
+    return RCVD_PKT_UPDATE_SUCCESS;
+  }
+  else if (header[1] == 0x7a)
+  { // Last update was successful
+    connected = true;
+    // return RCVD_PKT_CONNECT_SUCCESS;
+    return 1;
+  }
+
+  return RCVD_PKT_FAIL;
+}
+
+int HeatPump::findRegister(byte command)
+{
+  for (int i = 0; i < REGISTER_COUNT; i++)
+  {
+    if (REGISTER_COMMANDS[i] == command)
+    {
+      return i;
     }
   }
+  return -1;
+}
 
+// What processPacket() does for a reply that repeats the previous one: nothing changed, but it was received.
+int HeatPump::unchangedReply(byte command)
+{
+  pollReplyReceived(command, false);
+  switch (command)
+  {
+  case 0x02:
+    markState(STATE_SETTINGS, 0);
+    return RCVD_PKT_SETTINGS;
+  case 0x03:
+    markState(STATE_ROOM_TEMP, 0);
+    return RCVD_PKT_ROOM_TEMP;
+  case 0x05:
+    markState(STATE_TIMERS, 0);
+    return RCVD_PKT_TIMER;
+  case 0x06:
+    markState(STATE_OPERATING | STATE_COMPRESSOR | STATE_POWER_USAGE, 0);
+    return RCVD_PKT_STATUS;
+  }
   return RCVD_PKT_FAIL;
 }
 
+const byte *HeatPump::getRegister(byte command)
+{
+  int reg = findRegister(command);
+  if (reg < 0 || !(registersValid & (1 << reg)))
+  {
+    return nullptr;
+  }
+  return registers[reg];
+}
+
 void HeatPump::prepareInfoPacket(byte *packet, int length)
 {
   memset(packet, 0, length * sizeof(byte));
 
-  for (int i = 0; i < INFOHEADER_LEN && i < length; i++)
-  {
-    packet[i] = INFOHEADER[i];
-  }
+  memcpy_P(packet, INFOHEADER, INFOHEADER_LEN < length ? INFOHEADER_LEN : length);
 }
 
 void HeatPump::prepareSetPacket(byte *packet, int length)
 {
   memset(packet, 0, length * sizeof(byte));
 
-  for (int i = 0; i < HEADER_LEN && i < length; i++)
-  {
-    packet[i] = HEADER[i];
-  }
+  memcpy_P(packet, HEADER, HEADER_LEN < length ? HEADER_LEN : length);
 }
 
 heatpumpFunctions HeatPump::getFunctions()
 {
-  functions.clear();
+  return functions;
+}
+
+unsigned long HeatPump::getFunctionsReadAt()
+{
+  return functionsReadAt;
+}
+
+bool HeatPump::isFunctionsStale(unsigned long maxAgeMs)
+{
+  return functionsStale || !functions.isValid() || millis() - functionsReadAt > maxAgeMs;
+}
+
+bool HeatPump::isFetchingFunctions()
+{
+  return functionsFetching;
+}
+
+bool HeatPump::requestFunctions(heatpumpCommandCallback done)
+{
+  if ((capabilities & CAP_PROBED) && !(capabilities & CAP_FUNCTIONS))
+  {
+    return false; // the unit did not answer the probe, the requests would only time out
+  }
 
   byte packet1[PACKET_LEN] = {};
   byte packet2[PACKET_LEN] = {};
@@ -1183,32 +2490,22 @@ heatpumpFunctions HeatPump::getFunctions()
   packet2[5] = FUNCTIONS_GET_PART2;
   packet2[21] = checkSum(packet2, 21);
 
-  while (!canSend(false))
-  {
-    delay(10);
-  }
-  writePacket(packet1, PACKET_LEN);
-  readPacket();
-
-  while (!canSend(false))
+  if (commandQueueCount > COMMAND_QUEUE_LEN - 2)
   {
-    delay(10);
+    return false;
   }
-  writePacket(packet2, PACKET_LEN);
-  readPacket();
 
-  // retry reading a few times in case responses were related
-  // to other requests
-  for (int i = 0; i < 5 && !functions.isValid(); ++i)
+  // the callback goes with the second half, once it has run both halves have been answered (or timed out)
+  queueCommand(packet1, PACKET_LEN, CMD_PRIORITY_LOW, nullptr);
+  if (!queueCommand(packet2, PACKET_LEN, CMD_PRIORITY_LOW, done))
   {
-    delay(100);
-    readPacket();
+    return false;
   }
-
-  return functions;
+  functionsFetching = true;
+  return true;
 }
 
-bool HeatPump::setFunctions(heatpumpFunctions const &functions)
+bool HeatPump::setFunctions(heatpumpFunctions const &functions, heatpumpCommandCallback done)
 {
   if (!functions.isValid())
   {
@@ -1241,21 +2538,34 @@ bool HeatPump::setFunctions(heatpumpFunctions const &functions)
   packet1[21] = checkSum(packet1, 21);
   packet2[21] = checkSum(packet2, 21);
 
-  while (!canSend(false))
+  // only write the halves that differ from the cache, both of them if it cannot be trusted
+  bool trusted = this->functions.isValid() && !functionsStale;
+  byte cached[FUNCTIONS_HALF_LEN];
+  this->functions.getData1(cached);
+  bool write1 = !trusted || memcmp(cached, &packet1[6], FUNCTIONS_HALF_LEN) != 0;
+  this->functions.getData2(cached);
+  bool write2 = !trusted || memcmp(cached, &packet2[6], FUNCTIONS_HALF_LEN) != 0;
+
+  if (!write1 && !write2)
   {
-    delay(10);
+    if (done)
+    {
+      done(CMD_RESULT_OK); // nothing to write
+    }
+    return true;
   }
-  writePacket(packet1, PACKET_LEN);
-  readPacket();
 
-  while (!canSend(false))
+  if (commandQueueCount > COMMAND_QUEUE_LEN - (write1 + write2))
   {
-    delay(10);
+    return false;
   }
-  writePacket(packet2, PACKET_LEN);
-  readPacket();
 
-  return true;
+  // the callback goes with the last half written
+  if (write1)
+  {
+    queueCommand(packet1, PACKET_LEN, CMD_PRIORITY_NORMAL, write2 ? nullptr : done);
+  }
+  return !write2 || queueCommand(packet2, PACKET_LEN, CMD_PRIORITY_NORMAL, done);
 }
 
 heatpumpFunctions::heatpumpFunctions()
@@ -1354,12 +2664,12 @@ heatpumpFunctionCodes heatpumpFunctions::getAllCodes()
   return result;
 }
 
-bool heatpumpFunctions::operator==(const heatpumpFunctions &rhs)
+bool heatpumpFunctions::operator==(const heatpumpFunctions &rhs) const
 {
-  return this->isValid() == rhs.isValid() && memcmp(this->raw, rhs.raw, MAX_FUNCTION_CODE_COUNT * sizeof(int)) == 0;
+  return this->isValid() == rhs.isValid() && memcmp(this->raw, rhs.raw, sizeof(raw)) == 0;
 }
 
-bool heatpumpFunctions::operator!=(const heatpumpFunctions &rhs)
+bool heatpumpFunctions::operator!=(const heatpumpFunctions &rhs) const
 {
   return !(*this == rhs);
 }
@@ -24,12 +24,7 @@
 #include "WProgram.h"
 #endif
 
-#if defined(__WIFIKITSAMD__)
-  #include "wiring_private.h" 
-  #include <Uart.h>
-#endif
-
-#include <map>
+#include "HeatPumpTransport.h"
 
 /* 
  * Callback function definitions. Code differs for the ESP8266 platform, which requires the functional library.
@@ -39,19 +34,45 @@
 #include <functional>
 #define ON_CONNECT_CALLBACK_SIGNATURE std::function<void()> onConnectCallback
 #define SETTINGS_CHANGED_CALLBACK_SIGNATURE std::function<void()> settingsChangedCallback
-#define STATUS_CHANGED_CALLBACK_SIGNATURE std::function<void(heatpumpStatus newStatus)> statusChangedCallback
+#define STATUS_CHANGED_CALLBACK_SIGNATURE std::function<void(const heatpumpStatus& newStatus)> statusChangedCallback
 #define PACKET_CALLBACK_SIGNATURE std::function<void(byte* packet, unsigned int length, char* packetDirection)> packetCallback
 #define ROOM_TEMP_CHANGED_CALLBACK_SIGNATURE std::function<void(float currentRoomTemperature)> roomTempChangedCallback
+#define UPDATE_RESULT_CALLBACK_SIGNATURE std::function<void(unsigned int sequence, int result)> updateResultCallback
+typedef std::function<void(int result)> heatpumpCommandCallback;
 #else
 #define ON_CONNECT_CALLBACK_SIGNATURE void (*onConnectCallback)()
 #define SETTINGS_CHANGED_CALLBACK_SIGNATURE void (*settingsChangedCallback)()
 #define STATUS_CHANGED_CALLBACK_SIGNATURE void (*statusChangedCallback)(heatpumpStatus newStatus)
 #define PACKET_CALLBACK_SIGNATURE void (*packetCallback)(byte* packet, unsigned int length, char* packetDirection)
 #define ROOM_TEMP_CHANGED_CALLBACK_SIGNATURE void (*roomTempChangedCallback)(float currentRoomTemperature)
+#define UPDATE_RESULT_CALLBACK_SIGNATURE void (*updateResultCallback)(unsigned int sequence, int result)
+typedef void (*heatpumpCommandCallback)(int result);
 #endif
 
 #define	QUEUE_IMPLEMENTATION	FIFO
 
+// Frames kept by the packet trace, see setTraceEnabled(). Build with -DHEATPUMP_TRACE_FRAMES=0 to leave it out.
+#ifndef HEATPUMP_TRACE_FRAMES
+#define HEATPUMP_TRACE_FRAMES 16
+#endif
+
+// Other buffers every instance has, so every unit of a HeatPumpManager; smaller values save RAM per unit.
+// Queued commands (setFunctions() needs 2, requestFunctions() etc. one each), see sendCustomPacket()
+#ifndef HEATPUMP_COMMAND_QUEUE_LEN
+#define HEATPUMP_COMMAND_QUEUE_LEN 8
+#endif
+// Change notifications waiting for dispatchEvents(), one per EVENT_* kind and update result
+#ifndef HEATPUMP_EVENT_QUEUE_LEN
+#define HEATPUMP_EVENT_QUEUE_LEN 8
+#endif
+// Requests with their own BusStats counters and latency histogram, later ones only count in the totals
+#ifndef HEATPUMP_STATS_COMMANDS
+#define HEATPUMP_STATS_COMMANDS 12
+#endif
+#if HEATPUMP_COMMAND_QUEUE_LEN < 2 || HEATPUMP_EVENT_QUEUE_LEN < 1 || HEATPUMP_STATS_COMMANDS < 1
+#error "HEATPUMP_COMMAND_QUEUE_LEN must be at least 2, HEATPUMP_EVENT_QUEUE_LEN and HEATPUMP_STATS_COMMANDS at least 1"
+#endif
+
 typedef uint8_t byte;
 
 struct heatpumpSettings {
@@ -121,127 +142,399 @@ class heatpumpFunctions  {
 
     heatpumpFunctionCodes getAllCodes();   
 
-    bool operator==(const heatpumpFunctions& rhs);
-    bool operator!=(const heatpumpFunctions& rhs);
+    bool operator==(const heatpumpFunctions& rhs) const;
+    bool operator!=(const heatpumpFunctions& rhs) const;
 };
 
 class HeatPump
 {
+  public:
+    // Typed settings. The enumerator values index the lookup tables in HeatPump.cpp, strings are only
+    // needed at the MQTT/web edge (toString()/fromString() and the const char* API below).
+    enum class Power : uint8_t { Off, On };
+    enum class Mode : uint8_t { Heat, Dry, Cool, Fan, Auto };
+    enum class Fan : uint8_t { Auto, Quiet, Speed1, Speed2, Speed3, Speed4 };
+    enum class Vane : uint8_t { Auto, Pos1, Pos2, Pos3, Pos4, Pos5, Swing };
+    enum class WideVane : uint8_t { FarLeft, Left, Center, Right, FarRight, Split, Swing };
+
+    struct Settings {
+      Power power;
+      Mode mode;
+      uint8_t temperature; // half degrees Celsius, 46 = 23.0
+      Fan fan;
+      Vane vane;
+      WideVane wideVane;
+      bool iSee;
+
+      bool operator==(const Settings& rhs) const
+      {
+        return power == rhs.power && mode == rhs.mode && temperature == rhs.temperature && fan == rhs.fan &&
+               vane == rhs.vane && wideVane == rhs.wideVane && iSee == rhs.iSee;
+      }
+      bool operator!=(const Settings& rhs) const { return !(*this == rhs); }
+    };
+
+    // Settings fields, as returned by getPendingFields() and getInFlightFields()
+    static const byte FIELD_POWER       = 0x01;
+    static const byte FIELD_MODE        = 0x02;
+    static const byte FIELD_TEMPERATURE = 0x04;
+    static const byte FIELD_FAN         = 0x08;
+    static const byte FIELD_VANE        = 0x10;
+    static const byte FIELD_WIDEVANE    = 0x20;
+    static const byte FIELD_ALL         = 0x3F;
+    static const int SETTINGS_FIELD_COUNT = 6;
+
+    // State fields, as returned by getChangedSince(). The settings ones are the FIELD_* bits.
+    static const uint16_t STATE_ISEE        = 0x0040;
+    static const uint16_t STATE_ROOM_TEMP   = 0x0080;
+    static const uint16_t STATE_OPERATING   = 0x0100;
+    static const uint16_t STATE_COMPRESSOR  = 0x0200;
+    static const uint16_t STATE_POWER_USAGE = 0x0400;
+    static const uint16_t STATE_TIMERS      = 0x0800;
+    static const uint16_t STATE_FUNCTIONS   = 0x1000; // getFunctions()
+    static const uint16_t STATE_SETTINGS    = 0x007F; // FIELD_ALL and STATE_ISEE, getSettings()
+    static const uint16_t STATE_STATUS      = 0x0F80; // getStatus()
+    static const uint16_t STATE_ALL         = 0x1FFF;
+    static const int STATE_FIELD_COUNT = 13;
+
+    // CN105 timing learned from this unit's replies, see getTimingProfile()
+    struct TimingProfile {
+      uint16_t replyMs;       // smoothed reply latency
+      uint16_t replyDevMs;    // smoothed deviation of the reply latency
+      uint16_t powerSettleMs; // pause after a power change before the unit is asked again
+      uint16_t settleMs;      // pause after an acknowledged change before the settings are read back
+      uint16_t samples;       // replies measured so far, the reply timeout is learned after TIMING_MIN_SAMPLES
+    };
+
+    // CN105 bus counters, see getBusStats()
+    static const int LATENCY_BUCKETS = 8;
+    static const uint16_t LATENCY_BUCKET_MS[LATENCY_BUCKETS]; // upper bound of each latency bucket, 0 for the last (open) one
+    struct CommandStats {
+      byte type;    // request type (0x41 set, 0x42 info, 0x5a connect), 0 for an unused slot
+      byte command; // data[0] of the request
+      uint32_t sent;
+      uint32_t replied;
+      uint16_t latency[LATENCY_BUCKETS]; // replies per latency bucket
+    };
+    static const int STATS_COMMANDS_LEN = HEATPUMP_STATS_COMMANDS;
+    struct BusStats {
+      unsigned long since;     // millis() of the last reset
+      uint32_t framesSent;
+      uint32_t framesReceived; // valid frames
+      uint32_t checksumErrors;
+      uint32_t headerRejects;  // bytes dropped while looking for the start of a frame
+      uint32_t readTimeouts;   // partial frames whose remaining bytes never arrived
+      uint32_t replyTimeouts;  // requests without a reply
+      uint32_t controlSent;    // 0x41 packets, retransmits included
+      uint32_t controlAcked;   // 0x61 replies
+      uint32_t linkProbes;     // silences answered with out of turn settings requests, see getLinkState()
+      uint32_t linkResets;     // silences that needed the UART reopened
+      uint32_t linkReconnects; // silences that needed the full handshake
+      CommandStats commands[STATS_COMMANDS_LEN]; // per request, in order of first use; later ones only count in the totals
+    };
+
+    // payload (data[1..15]) of the last reply to each info request, see getRegister()
+    static const int REGISTER_COUNT = 6;
+    static const int REGISTER_LEN = 15;
+    static const byte REGISTER_COMMANDS[REGISTER_COUNT]; // 0x02 settings, 0x03 room temperature, 0x04, 0x05 timers, 0x06 status, 0x09 standby
+
+    // raw CN105 frames recorded by the packet trace, see popTrace()
+    static const byte TRACE_SENT = 0;
+    static const byte TRACE_RECEIVED = 1;
+    static const int TRACE_FRAME_LEN = 22; // longer frames are cut
+    struct TraceEntry {
+      unsigned long time; // millis() when the frame was written or completed
+      byte direction;     // TRACE_SENT or TRACE_RECEIVED
+      byte length;        // bytes in frame[]
+      byte frame[TRACE_FRAME_LEN];
+    };
+
+    // framing of the CN105 line, see checkFrame()
+    static const int FRAME_MAX_LEN = 5 + 32 + 1; // header, data, checksum
+    static const int FRAME_INCOMPLETE = 0;
+    static const int FRAME_BAD_HEADER = -1;
+    static const int FRAME_BAD_CHECKSUM = -2;
+
   private:
     static const int PACKET_LEN = 22;
     static const int PACKET_SENT_INTERVAL_MS = 5000;  //Request new info/send data to the A/C with at least 5s gap.
     int  packet_sent_delay_interval_ms = PACKET_SENT_INTERVAL_MS; 
+    static const unsigned long COALESCE_WINDOW_MS = 300; // setters called within this window go out in one 0x41 packet
+    static const int COALESCE_MAX_WINDOWS = 4;           // but never hold a change back longer than this many windows
     // static const int PACKET_SENT_INTERVAL_MS = 500;
-    static const int PACKET_INFO_INTERVAL_MS = 1000;
-    // static const int PACKET_INFO_INTERVAL_MS = 100;
+    static const int PACKET_GAP_MS = 50;  //Quiet time on the bus after a reply before the next request is sent
     static const int PACKET_TYPE_DEFAULT = 99;
     static const int PACKET_RESPONSE_WAIT_TIME = 500;   //Response packet from A/C should arrive less than 500ms (Typical 100-200ms)
-
+    static const int UPDATE_MAX_ATTEMPTS = 3;              // control packet is sent at most this many times without an ack
+    static const unsigned long UPDATE_RETRY_BACKOFF_MS = 500; // pause before the first retransmit, doubled for each further one
+    static const unsigned long CONNECT_SETTLE_MS = 2000; // let the line settle after opening the port, before the CONNECT packet
+    static const unsigned long COMMAND_QUEUE_TIMEOUT_MS = 30000; // queued commands not sent by then are dropped (covers the 15 s wait after a power change)
+
+    // silence on the bus, see checkLink(). Settings are polled at least every 10 s, so 15 s without a frame is not normal
+    static const unsigned long LINK_PROBE_MS = 15000;         // ask for the settings out of turn
+    static const unsigned long LINK_PROBE_INTERVAL_MS = 2000;
+    static const int LINK_PROBES = 3;                         // per stage
+    static const unsigned long LINK_RESET_MS = 30000;         // reopen the UART
+    static const unsigned long LINK_RECONNECT_MS = PACKET_SENT_INTERVAL_MS * 12; // full handshake, as connect()
+
+    // bounds of the learned timing profile, the defaults are the upper bounds
+    static const int TIMING_MIN_SAMPLES = 16;
+    static const unsigned long RESPONSE_WAIT_MIN_MS = 200;
+    static const unsigned long RESPONSE_WAIT_MAX_MS = 1000;
+    static const unsigned long POWER_SETTLE_MIN_MS = 3000;
+    static const unsigned long POWER_SETTLE_MAX_MS = PACKET_SENT_INTERVAL_MS + 10000;
+    static const unsigned long SETTLE_MAX_MS = 5000;
+    static const unsigned long SETTLE_RETRY_MS = 250; // read the settings again this soon while they still show the old values
+
+    // packet templates and lookup tables are shared by all instances and live in HeatPump.cpp (PROGMEM where
+    // they are only copied), keep per-instance members for state
     static const int CONNECT_LEN = 8;
-    const byte CONNECT[CONNECT_LEN] = {0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01, 0xa8};
     static const int HEADER_LEN  = 8;
-    const byte HEADER[HEADER_LEN]  = {0xfc, 0x41, 0x01, 0x30, 0x10, 0x01, 0x00, 0x00};
-
     static const int INFOHEADER_LEN  = 5;
-    const byte INFOHEADER[INFOHEADER_LEN]  = {0xfc, 0x42, 0x01, 0x30, 0x10};
-    
- 
-    static const int INFOMODE_LEN = 4;
-    const byte INFOMODE[INFOMODE_LEN] = {
-      0x02, // request a settings packet - RQST_PKT_SETTINGS
-      0x03, // request the current room temp - RQST_PKT_ROOM_TEMP
-      // 0x04, // unknown
-      0x05, // request the timers - RQST_PKT_TIMERS
-      0x06, // request status - RQST_PKT_STATUS
-      // 0x09, // request standby mode (maybe?) RQST_PKT_STANDBY
-      // 0x20, //	Unknown 
-      // 0x22 //	Unknown 
+
+    // Info requests are scheduled by staleness instead of round-robin. Each request type is polled no
+    // faster than minIntervalMs and no slower than maxIntervalMs; in between, the target age is learned
+    // from how often the reply actually changes, and priority weights how urgent a stale value is.
+    struct PollSlotConfig {
+      byte command;
+      byte priority;
+      unsigned long minIntervalMs;
+      unsigned long maxIntervalMs;
     };
 
-    byte infomodecmd = 0x01;
-
-
-
-    const int RCVD_PKT_FAIL            = 0;
-    const int RCVD_PKT_CONNECT_SUCCESS = 1;
-    const int RCVD_PKT_SETTINGS        = 2;
-    const int RCVD_PKT_ROOM_TEMP       = 3;
-    const int RCVD_PKT_UPDATE_SUCCESS  = 4;
-    const int RCVD_PKT_STATUS          = 5;
-    const int RCVD_PKT_TIMER           = 6;
-    const int RCVD_PKT_FUNCTIONS       = 7;
-
-    const byte CONTROL_PACKET_1[5] = {0x01,    0x02,  0x04,  0x08, 0x10};
-                                   //{"POWER","MODE","TEMP","FAN","VANE"};
-    const byte CONTROL_PACKET_2[1] = {0x01};
-                                   //{"WIDEVANE"};
-    const byte POWER[2]            = {0x00, 0x01};
-    const char* POWER_MAP[2]       = {"OFF", "ON"};
-    const byte MODE[5]             = {0x01,   0x02,  0x03, 0x07, 0x08};
-    const char* MODE_MAP[5]        = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
-    const byte TEMP[16]            = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
-    const int TEMP_MAP[16]         = {31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16};
-    const byte FAN[6]              = {0x00,  0x01,   0x02, 0x03, 0x05, 0x06};
-    const char* FAN_MAP[6]         = {"AUTO", "QUIET", "1", "2", "3", "4"};
-    const byte VANE[7]             = {0x00,  0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
-    const char* VANE_MAP[7]        = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
-    const byte WIDEVANE[7]         = {0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x0c};
-    const char* WIDEVANE_MAP[7]    = {"<<", "<",  "|",  ">",  ">>", "<>", "SWING"};
-    const byte ROOM_TEMP[32]       = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-                                      0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
-    const int ROOM_TEMP_MAP[32]    = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
-                                      26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41};
-    const byte TIMER_MODE[4]       = {0x00,  0x01,  0x02, 0x03};
-    const char* TIMER_MODE_MAP[4]  = {"NONE", "OFF", "ON", "BOTH"};
+    struct PollSlotState {
+      unsigned long lastPolled;
+      unsigned long targetMs;   // learned target freshness, between minIntervalMs and maxIntervalMs
+      unsigned long boostUntil; // poll at minIntervalMs until then
+      bool due;                 // explicitly requested through setInfoModeIndex()/sync(packetType)
+    };
+
+    static const int INFOMODE_LEN = 4;
+    static const PollSlotConfig INFOMODE[INFOMODE_LEN]; // indexed by RQST_PKT_*
+    PollSlotState pollState[INFOMODE_LEN];
+
+    static const unsigned long POLL_BOOST_MS = 60000; // how long to poll settings fast after an external (IR remote) change
+
+    static const int RCVD_PKT_FAIL            = 0;
+    static const int RCVD_PKT_CONNECT_SUCCESS = 1;
+    static const int RCVD_PKT_SETTINGS        = 2;
+    static const int RCVD_PKT_ROOM_TEMP       = 3;
+    static const int RCVD_PKT_UPDATE_SUCCESS  = 4;
+    static const int RCVD_PKT_STATUS          = 5;
+    static const int RCVD_PKT_TIMER           = 6;
+    static const int RCVD_PKT_FUNCTIONS       = 7;
+
+    static const int ROOM_TEMP_MIN = 10; // 0x00 in the whole degree room temperature encoding, 0x1f = 41
+    static const int ROOM_TEMP_LEN = 32;
+    static const int TIMER_MODE_LEN = 4;
+    static const char* const TIMER_MODE_MAP[TIMER_MODE_LEN]; // indexed by the timer mode byte
 
     static const int TIMER_INCREMENT_MINUTES = 10;
 
-    const byte FUNCTIONS_SET_PART1 = 0x1F;
-    const byte FUNCTIONS_GET_PART1 = 0x20;
-    const byte FUNCTIONS_SET_PART2 = 0x21;
-    const byte FUNCTIONS_GET_PART2 = 0x22;
+    static const byte FUNCTIONS_SET_PART1 = 0x1F;
+    static const byte FUNCTIONS_GET_PART1 = 0x20;
+    static const byte FUNCTIONS_SET_PART2 = 0x21;
+    static const byte FUNCTIONS_GET_PART2 = 0x22;
+    static const int FUNCTIONS_HALF_LEN = 15; // data bytes of each half, see heatpumpFunctions::setData1()
 
-    // these settings will be initialised in connect()
-    heatpumpSettings currentSettings {};
-    heatpumpSettings wantedSettings {};
+    // these settings will be initialised by the first settings reply after connect()
+    Settings currentSettings {};
+    Settings wantedSettings {};
+    bool settingsReceived = false;
     // heatpumpSettings lastSentSettings {};
 
     // initialise to all off, then it will update shortly after connect;
     heatpumpStatus currentStatus {0, false, {TIMER_MODE_MAP[0], 0, 0, 0, 0}, 0};
 
+    // function codes as last read from the A/C, or written and acknowledged
     heatpumpFunctions functions;
+    unsigned long functionsReadAt = 0; // millis() of the last complete read, 0 if never
+    bool functionsStale = true;        // a write failed or the A/C was reconnected since that read
+    bool functionsFetching = false;    // requestFunctions() queued, the second half has not been answered yet
+
+    // remote temperature stream, see streamRemoteTemperature()
+    static const byte REMOTE_TEMP_SET = 0x07;
+    bool remoteTempStreaming = false;
+    float remoteTemp = 0;                     // latest value, 0 for the unit's own sensor
+    unsigned long remoteTempAt = 0;           // millis() of the latest value
+    float remoteTempSent = 0;                 // last value the unit acknowledged
+    unsigned long remoteTempSentAt = 0;       // 0 if not acknowledged since connect
+    unsigned long remoteTempTriedAt = 0;      // last time a value was queued
+    bool remoteTempQueued = false;            // a 0x07 is queued or in flight
+    float remoteTempDeadband = 0.3;
+    unsigned long remoteTempMinIntervalMs = 10000;
+    unsigned long remoteTempRefreshMs = 60000;
+    unsigned long remoteTempTimeoutMs = 0;
   
-    #if defined(__WIFIKITSAMD__)
-    Uart * _HardSerial {nullptr};
-    #else
-      HardwareSerial * _HardSerial {nullptr};
-    #endif
+    HeatPumpSerialTransport serialTransport; // used by the connect() overloads that take a serial port
+    HeatPumpTransport *transport = nullptr;
 
     unsigned long lastSend;
+    unsigned long lastReply;
+    byte awaitedReplyHeader = 0; // header[1] of the reply to the last request, 0 when nothing is outstanding
+    byte awaitedReplyCommand = 0; // data[0] the reply must echo (0x62 info replies only)
     unsigned long lastSendUpdate;
     // bool waitForRead;
-    int infoMode;
     unsigned long lastRecv;
     bool connected = false;
+
+    // connect handshake, advanced by sync()
+    static const byte CONNECT_IDLE       = 0;
+    static const byte CONNECT_SETTLING   = 1;
+    static const byte CONNECT_WAIT_REPLY = 2;
+    byte connectState = CONNECT_IDLE;
+    unsigned long connectStateSince = 0;
+
+    byte linkState = 0; // LINK_*
+    int linkProbesSent = 0;
+    unsigned long linkProbeAt = 0;
+    int connectBitrate = 2400;
+    int preferredBitrate = 2400; // bitrate of the last successful connect, tried first
+    bool connectAutoBitrate = true;
+    int connectAttempt = 0;
+
+    // capability profile, CAP_* bits, learned from the replies and completed by a one-time probe after connect
+    uint16_t capabilities = 0;
+    int probeStep = -1; // index into PROBE_COMMANDS while probing, -1 otherwise
+    int probeAttempt = 0;
+    bool probeSent = false;
+    static const int PROBE_MAX_ATTEMPTS = 2; // an unanswered probe request is sent once more before the unit is marked as not supporting it
     bool autoUpdate;
     bool firstRun;
     bool tempMode;
     bool externalUpdate;
     bool wideVaneAdj;
-    bool updating = false;
-    bool powerSettingUpdate = false;
+    bool updating = false; // a control packet is waiting for its ack
+    bool updateAcked = false;
+    byte updatePacket[PACKET_LEN] = {};
+    Settings sentSettings {};
+    unsigned int updateSequence = 0;
+
+    // per-field reconciliation of wantedSettings against currentSettings, bits are the FIELD_* constants
+    byte pendingFields = 0;  // set by a setter, not sent yet
+    byte inFlightFields = 0; // in updatePacket, waiting for the ack
+    unsigned long fieldChangedAt[SETTINGS_FIELD_COUNT] = {}; // millis() of the last setter call per field
+
+    // change tracking of the A/C's state, bits are the STATE_* constants, see getChangedSince()
+    uint32_t stateSequence = 0;
+    uint32_t stateFieldSequence[STATE_FIELD_COUNT] = {};   // stateSequence of the last change per field
+    unsigned long stateReceivedAt[STATE_FIELD_COUNT] = {}; // millis() of the last reply carrying the field
+    uint16_t stateReceived = 0;                            // fields received at least once
+
+    // learned timing, see learnReplyLatency(), learnPowerSettle() and learnSettle()
+    TimingProfile timing {0, 0, POWER_SETTLE_MAX_MS, 0, 0};
+    unsigned long responseWaitMs = PACKET_RESPONSE_WAIT_TIME;
+    bool replyTimeoutSeen = false;
+    bool powerSettleCheck = false;  // power change acknowledged, the first info request after the pause tells if it was long enough
+    bool powerSettleProbe = false;  // that info request is in flight
+    byte settleFields = 0;          // acknowledged fields the settings replies have not confirmed yet
+    unsigned long settleAckAt = 0;
+    int settleReadbacks = 0;
+    bool readbackPending = false;
+    unsigned long readbackAt = 0;
+
+    // replies identical to the previous one of the same command are not decoded again
+    byte registers[REGISTER_COUNT][REGISTER_LEN] = {};
+    byte registersValid = 0; // bit per REGISTER_COMMANDS entry, cleared on connect
+
+    BusStats busStats {};
+    int busStatsSlot = -1; // busStats.commands[] entry of the outstanding request
+
+    bool traceEnabled = false;
+#if HEATPUMP_TRACE_FRAMES > 0
+    // only the bytes are copied here, they are formatted when the trace is read
+    TraceEntry traceRing[HEATPUMP_TRACE_FRAMES];
+    int traceHead = 0; // oldest entry
+    int traceCount = 0;
+    uint32_t traceDropped = 0;
+    void traceFrame(byte direction, const byte *frame, int length);
+#endif
 
-    const char* lookupByteMapValue(const char* valuesMap[], const byte byteMap[], int len, byte byteValue);
-    int    lookupByteMapValue(const int valuesMap[], const byte byteMap[], int len, byte byteValue);
-    int    lookupByteMapIndex(const char* valuesMap[], int len, const char* lookupValue);
-    int    lookupByteMapIndex(const int valuesMap[], int len, int lookupValue);
+    // change notifications, queued while decoding and dispatched by dispatchEvents() outside of readPacket()
+    struct queuedEvent {
+      byte type;             // one EVENT_* bit
+      unsigned int sequence; // EVENT_UPDATE_RESULT only
+      int result;            // EVENT_UPDATE_RESULT only
+    };
+    static const int EVENT_QUEUE_LEN = HEATPUMP_EVENT_QUEUE_LEN;
+    queuedEvent eventQueue[EVENT_QUEUE_LEN];
+    int eventHead = 0;
+    int eventCount = 0;
+    byte eventMask;
+    bool manualDispatch = false;
+    unsigned int droppedEvents = 0;
+    int updateAttempts = 0;
+    bool powerSettingUpdate = false;
 
+    // outgoing transactions other than the settings update and the info poll, sent from sync() one at a time
+    struct queuedCommand {
+      byte packet[PACKET_LEN];
+      int length;
+      byte priority;
+      unsigned long queuedAt;
+      heatpumpCommandCallback done;
+    };
+    static const int COMMAND_QUEUE_LEN = HEATPUMP_COMMAND_QUEUE_LEN;
+    queuedCommand commandQueue[COMMAND_QUEUE_LEN];
+    int commandQueueCount = 0;
+    queuedCommand inFlightCommand;
+    bool commandInFlight = false;
+    bool commandReplied = false;
+
+    // command coalescing, see wantedSettingsChanged()
+    unsigned long coalesceWindowMs = COALESCE_WINDOW_MS;
+    unsigned long firstWantedChange = 0;
+    unsigned long lastWantedChange = 0;
+    bool wantedChangePending = false;
+
+    // receive parser state, kept between calls so a frame may arrive over several sync() calls
+    static const int MAX_DATA_LEN = FRAME_MAX_LEN - INFOHEADER_LEN - 1;
+    byte rxBuffer[INFOHEADER_LEN + MAX_DATA_LEN + 1] = {}; // header + data bytes + checksum byte
+    int rxLen = 0;
+    unsigned long rxStartTime = 0;
+
+
+    bool startConnect(int bitrate);
+    void beginConnect(int bitrate);
+    void advanceConnect();
+    void probeCapabilities();
+    static uint16_t capabilityForCommand(byte command);
     bool canSend(bool isInfo);
-    bool canRead();
-    byte checkSum(byte bytes[], int len);
-    void createPacket(byte *packet, heatpumpSettings settings);
-    void createInfoPacket(byte *packet, byte packetType);
+    void processUpdate();
+    bool queueCommand(byte *packet, int length, byte priority, heatpumpCommandCallback done);
+    void sendQueuedCommand();
+    void queueRemoteTemperature();
+    void createRemoteTemperaturePacket(byte *packet, float setting);
+    void processCommandQueue();
+    void removeQueuedCommand(int index);
+    void finishCommand(queuedCommand &command, int result);
+    void wantedSettingsChanged(byte field);
+    static byte diffSettings(const Settings &a, const Settings &b);
+    static void copySettingsFields(Settings &to, const Settings &from, byte fields);
+    bool coalesceWindowElapsed();
+    bool awaitingReply();
+    void checkReplyTimeout();
+    bool checkLink();
+    void learnReplyLatency(unsigned long latency);
+    void learnPowerSettle(bool settled);
+    void learnSettle(unsigned long sample, bool firstReadback);
+    void updateResponseWait();
+    int findBusStatsSlot(byte type, byte command);
+    void markState(uint16_t received, uint16_t changed);
+    void queueEvent(byte type, unsigned int sequence = 0, int result = 0);
+    static byte checkSum(const byte bytes[], int len);
+    void createPacket(byte *packet, const Settings &settings, byte fields);
+    void createInfoPacket(byte *packet, int index);
+    int selectInfoIndex(byte packetType);
+    int findInfoIndex(byte command);
+    int findRegister(byte command);
+    int unchangedReply(byte command);
+    void pollReplyReceived(byte command, bool changed);
+    void boostPoll(byte command);
     int readPacket(bool waitForPacket = false);   //waitForPacket = blocking and wait for packet to arrive
+    int findFrame();
+    void discardReceived(int count);
+    int processPacket();
     void writePacket(byte *packet, int length);
     void prepareInfoPacket(byte* packet, int length);
     void prepareSetPacket(byte* packet, int length);
@@ -252,18 +545,54 @@ class HeatPump
     STATUS_CHANGED_CALLBACK_SIGNATURE {nullptr};
     PACKET_CALLBACK_SIGNATURE {nullptr};
     ROOM_TEMP_CHANGED_CALLBACK_SIGNATURE {nullptr};
+    UPDATE_RESULT_CALLBACK_SIGNATURE {nullptr};
 
   public:
     // indexes for INFOMODE array (public so they can be optionally passed to sync())
-    const int RQST_PKT_SETTINGS  = 0;
-    const int RQST_PKT_ROOM_TEMP = 1;
-    const int RQST_PKT_TIMERS    = 3;
-    const int RQST_PKT_STATUS    = 4;
-    const int RQST_PKT_STANDBY   = 5;
+    static const int RQST_PKT_SETTINGS  = 0;
+    static const int RQST_PKT_ROOM_TEMP = 1;
+    static const int RQST_PKT_TIMERS    = 2;
+    static const int RQST_PKT_STATUS    = 3;
+    static const int RQST_PKT_STANDBY   = 4; // not polled, 0x09 is disabled in INFOMODE
+    static const byte PACKET_TYPE_NO_POLL = 98; // sync() without starting an info request, see HeatPumpManager
+
+    // change events, see dispatchEvents()
+    static const byte EVENT_SETTINGS      = 0x01; // settingsChangedCallback
+    static const byte EVENT_STATUS        = 0x02; // statusChangedCallback
+    static const byte EVENT_ROOM_TEMP     = 0x04; // roomTempChangedCallback
+    static const byte EVENT_UPDATE_RESULT = 0x08; // updateResultCallback
+    static const byte EVENT_ALL           = 0x0F;
+
+    // capability profile, see getCapabilities()
+    static const uint16_t CAP_SETTINGS    = 0x0001; // answers the 0x02 settings request
+    static const uint16_t CAP_ROOM_TEMP   = 0x0002; // answers 0x03
+    static const uint16_t CAP_TIMERS      = 0x0004; // answers 0x05
+    static const uint16_t CAP_STATUS      = 0x0008; // answers 0x06
+    static const uint16_t CAP_STANDBY     = 0x0010; // answers 0x09
+    static const uint16_t CAP_FUNCTIONS   = 0x0020; // answers 0x20/0x22
+    static const uint16_t CAP_HALF_DEGREE = 0x0100; // reports the set point in half degrees
+    static const uint16_t CAP_WIDE_VANE   = 0x0200; // reports a wide vane position
+    static const uint16_t CAP_ISEE        = 0x0400; // has reported the i-See sensor active
+    static const uint16_t CAP_PROBED      = 0x8000; // the probe has run, requests without their bit are not answered
+
+    // handling of a silent A/C, see getLinkState(); the next step after that is the full handshake
+    static const byte LINK_OK       = 0; // a frame arrived in the last 15 s
+    static const byte LINK_PROBING  = 1; // asking for the settings out of turn
+    static const byte LINK_RESET    = 2; // the UART was reopened, probing again
+
+    // priorities and results of queued commands (setRemoteTemperature, setFunctions, requestFunctions, sendCustomPacket)
+    static const byte CMD_PRIORITY_LOW    = 0;
+    static const byte CMD_PRIORITY_NORMAL = 1;
+    static const byte CMD_PRIORITY_HIGH   = 2;
+    static const int CMD_RESULT_OK        = 0; // the A/C replied
+    static const int CMD_RESULT_TIMEOUT   = 1; // sent, but no reply within the reply timeout
+    static const int CMD_RESULT_EXPIRED   = 2; // could not be sent within COMMAND_QUEUE_TIMEOUT_MS
 
     // general
     HeatPump();
 
+    // connect() opens the port and starts the handshake, call sync() until isConnected() (or !isConnecting())
+
     #if defined(__WIFIKITSAMD__)
       bool connect(Uart *serial, int bitrate = 2400);
     #else
@@ -272,6 +601,8 @@ class HeatPump
       bool connect(HardwareSerial *serial, int rx, int tx);
       bool connect(HardwareSerial *serial, int bitrate, int rx, int tx);
     #endif
+    bool connect(HeatPumpTransport *transport, int bitrate = 0); // any byte stream, e.g. a HeatPumpStreamTransport to a CN105 bridge
+    void disconnect(); // stop using the transport, e.g. while something else talks to the A/C; sync() reconnects
     bool update();
     void sync(byte packetType = PACKET_TYPE_DEFAULT);
     void setInfoModeIndex(int index = 0);
@@ -279,6 +610,12 @@ class HeatPump
     void disableExternalUpdate();
     void enableAutoUpdate();
     void disableAutoUpdate();
+    void setCoalesceWindow(unsigned long windowMs);
+    void dispatchEvents(); // run the callbacks of the queued changes, sync() does it unless enableManualDispatch() was called
+    void enableManualDispatch();
+    void disableManualDispatch();
+    void setEventMask(byte mask); // EVENT_* bits that are queued, the others are dropped right away
+    unsigned int getDroppedEvents(); // events lost because the queue was full
 
     // settings
     heatpumpSettings getSettings();
@@ -291,7 +628,11 @@ class HeatPump
     void setModeSetting(const char* setting);
     float getTemperature();
     void setTemperature(float setting);
-    void setRemoteTemperature(float setting);
+    bool setRemoteTemperature(float setting, heatpumpCommandCallback done = nullptr);
+    void streamRemoteTemperature(float setting); // latest sensor value, sent by sync() as setRemoteTemperatureTiming() allows
+    void setRemoteTemperatureTiming(float deadband, unsigned long minIntervalMs, unsigned long refreshMs, unsigned long timeoutMs = 0);
+    float getRemoteTemperature(); // last value the unit acknowledged, 0 if it uses its own sensor
+    unsigned long getRemoteTemperatureSentAt(); // millis() of that acknowledgement, 0 if none since connect
     const char* getFanSpeed();
     void setFanSpeed(const char* setting);
     const char* getVaneSetting();
@@ -300,17 +641,79 @@ class HeatPump
     void setWideVaneSetting(const char* setting);
     bool getIseeBool();
 
+    // typed settings, see Settings
+    Settings getTypedSettings();
+    void setTypedSettings(const Settings &settings);
+    Power getPower();
+    void setPowerSetting(Power setting);
+    Mode getMode();
+    void setModeSetting(Mode setting);
+    uint8_t getTemperatureHalfDeg();
+    void setTemperatureHalfDeg(uint8_t halfDegrees);
+    Fan getFan();
+    void setFanSpeed(Fan setting);
+    Vane getVane();
+    void setVaneSetting(Vane setting);
+    WideVane getWideVane();
+    void setWideVaneSetting(WideVane setting);
+
+    static const char* toString(Power value);
+    static const char* toString(Mode value);
+    static const char* toString(Fan value);
+    static const char* toString(Vane value);
+    static const char* toString(WideVane value);
+    static bool fromString(const char* name, Power &value); // case insensitive, false if unknown
+    static bool fromString(const char* name, Mode &value);
+    static bool fromString(const char* name, Fan &value);
+    static bool fromString(const char* name, Vane &value);
+    static bool fromString(const char* name, WideVane &value);
+
     // status
     heatpumpStatus getStatus();
     float getRoomTemperature();
     bool getOperating();
     bool isConnected();
+    bool isConnecting();
+    bool isAwaitingReply(); // a request is on the wire and its reply timeout has not passed
+    int getPreferredBitrate();
+    void setPreferredBitrate(int bitrate); // e.g. the bitrate saved from the last session, 2400 or 9600
+    uint16_t getCapabilities(); // CAP_* bits, save them once CAP_PROBED is set
+    void setCapabilities(uint16_t capabilities); // e.g. saved from the last session, a profile with CAP_PROBED skips the probe
+    bool hasCapability(uint16_t capability);
+    bool isProbing();
+    byte getLinkState(); // LINK_*, how far the handling of a silent A/C has gone
+    TimingProfile getTimingProfile(); // save it from time to time, it changes with every reply
+    void setTimingProfile(const TimingProfile &profile); // e.g. saved from the last session, clamped to safe bounds
+    unsigned long getResponseWaitMs(); // current reply timeout
+    BusStats getBusStats(); // snapshot of the bus counters
+    const byte *getRegister(byte command); // REGISTER_LEN bytes of the last reply to that info request, nullptr if none since connect
+    void resetBusStats();
+    void setTraceEnabled(bool enabled); // record every frame sent and received, off by default
+    bool isTraceEnabled();
+    bool popTrace(TraceEntry &entry); // oldest recorded frame, false if there is none
+    uint32_t getTraceDropped(); // frames overwritten before they were popped
+    static size_t formatTrace(const TraceEntry &entry, char *buffer, size_t size); // "fc 42 01 30 ...", returns the length
+    // length of the valid frame at the start of buffer, FRAME_INCOMPLETE if more bytes are needed; on FRAME_BAD_*
+    // buffer[0] cannot start a frame, drop it and look again from the next byte
+    static int checkFrame(const byte *buffer, int length);
     bool sendPending();
+    bool isUpdating();
+    unsigned int getUpdateSequence(); // sequence number of the last update() sent, passed to the update result callback
+    byte getPendingFields();  // FIELD_* bits changed by a setter and not sent yet
+    byte getInFlightFields(); // FIELD_* bits sent and waiting for the ack
+    unsigned long getFieldChangedAt(byte field); // millis() of the last setter call for a FIELD_*, 0 if never set
+    uint32_t getStateSequence(); // bumped by every reply or acknowledged update that changed the A/C's state
+    uint16_t getChangedSince(uint32_t sequence); // STATE_* bits changed after that sequence, pass 0 for everything received
+    unsigned long getReceivedAt(uint16_t field); // millis() of the last reply carrying a STATE_* field, 0 if never
 
     // functions
     // NOTE: These methods have been tested with a PVA (P-series air handler) unit and has not been tested with anything else. Use at your own risk.
-    heatpumpFunctions getFunctions();
-    bool setFunctions(heatpumpFunctions const& functions);
+    heatpumpFunctions getFunctions(); // cached functions, refresh with requestFunctions() once isFunctionsStale()
+    bool requestFunctions(heatpumpCommandCallback done = nullptr); // false if queue full or the unit has no CAP_FUNCTIONS
+    bool setFunctions(heatpumpFunctions const& functions, heatpumpCommandCallback done = nullptr); // writes the changed halves only
+    unsigned long getFunctionsReadAt(); // millis() of the last complete read, 0 if never
+    bool isFunctionsStale(unsigned long maxAgeMs); // never read, older than maxAgeMs, or possibly changed since
+    bool isFetchingFunctions();
     
     // helpers
     float FahrenheitToCelsius(int tempF);
@@ -322,9 +725,10 @@ class HeatPump
     void setStatusChangedCallback(STATUS_CHANGED_CALLBACK_SIGNATURE);
     void setPacketCallback(PACKET_CALLBACK_SIGNATURE);
     void setRoomTempChangedCallback(ROOM_TEMP_CHANGED_CALLBACK_SIGNATURE); // need to deprecate this, is available from setStatusChangedCallback
+    void setUpdateResultCallback(UPDATE_RESULT_CALLBACK_SIGNATURE); // CMD_RESULT_OK once acknowledged, CMD_RESULT_TIMEOUT after UPDATE_MAX_ATTEMPTS
 
     // expert users only!
-    void sendCustomPacket(byte data[], int len); 
+    bool sendCustomPacket(byte data[], int len, heatpumpCommandCallback done = nullptr);
 
 };
 #endif
@@ -0,0 +1,148 @@
+/*
+  HeatPumpBridge.cpp - CN105 frames between a remote controller and the heat pump
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "HeatPumpBridge.h"
+
+HeatPumpBridge::HeatPumpBridge(HeatPumpTransport *unit, HeatPumpTransport *client) : unit(unit), client(client)
+{
+}
+
+void HeatPumpBridge::begin(int bitrate)
+{
+  unit->begin(bitrate);
+  fromUnit.length = 0;
+  fromClient.length = 0;
+  requestHeld = 0;
+  awaitingReply = false;
+}
+
+void HeatPumpBridge::loop()
+{
+  // replies (and anything else the heat pump sends) go to the client as soon as they are complete
+  int length;
+  while ((length = readFrame(unit, fromUnit)) > 0)
+  {
+    client->write(fromUnit.buffer, length);
+    consume(fromUnit, length);
+    stats.framesFromUnit++;
+    awaitingReply = false;
+    lastUnitFrameAt = millis();
+  }
+
+  if (requestHeld == 0)
+  {
+    requestHeld = readFrame(client, fromClient);
+  }
+  if (requestHeld == 0)
+  {
+    return;
+  }
+
+  if (awaitingReply)
+  {
+    if (millis() - requestSentAt < REPLY_TIMEOUT_MS)
+    {
+      return;
+    }
+    awaitingReply = false;
+    stats.replyTimeouts++;
+  }
+  if (millis() - lastUnitFrameAt < GAP_MS)
+  {
+    return;
+  }
+
+  unit->write(fromClient.buffer, requestHeld);
+  stats.framesToUnit++;
+  consume(fromClient, requestHeld);
+  requestHeld = 0;
+  awaitingReply = true;
+  requestSentAt = millis();
+}
+
+HeatPumpBridge::Stats HeatPumpBridge::getStats()
+{
+  return stats;
+}
+
+void HeatPumpBridge::resetStats()
+{
+  stats = Stats {};
+}
+
+// Collect the next frame from a transport without waiting. Returns its length once it is complete and its
+// checksum matches, 0 while it is not. A byte that cannot start a valid frame is dropped and the bytes after it
+// are checked again, so a glitch inside a frame does not cost the frame that follows.
+int HeatPumpBridge::readFrame(HeatPumpTransport *from, frameReader &reader)
+{
+  if (reader.length > 0 && millis() - reader.startedAt > FRAME_TIMEOUT_MS)
+  {
+    discard(reader, 1); // the rest never came, maybe a frame starts further in
+  }
+
+  for (;;)
+  {
+    // what is left after a frame or a dropped byte may already hold the next frame; the buffer never grows
+    // past a frame, a longer one fails the header check
+    while (reader.length > 0)
+    {
+      int frameLen = HeatPump::checkFrame(reader.buffer, reader.length);
+      if (frameLen > 0)
+      {
+        return frameLen;
+      }
+      if (frameLen == HeatPump::FRAME_INCOMPLETE)
+      {
+        break;
+      }
+      discard(reader, 1);
+    }
+
+    if (from->available() <= 0)
+    {
+      return 0;
+    }
+    int c = from->read();
+    if (c < 0)
+    {
+      return 0;
+    }
+    if (reader.length == 0)
+    {
+      reader.startedAt = millis();
+    }
+    reader.buffer[reader.length++] = c;
+  }
+}
+
+// Remove the first count bytes, the next frame starts after them
+void HeatPumpBridge::consume(frameReader &reader, int count)
+{
+  if (count > reader.length)
+  {
+    count = reader.length;
+  }
+  memmove(reader.buffer, reader.buffer + count, reader.length - count);
+  reader.length -= count;
+  reader.startedAt = millis();
+}
+
+void HeatPumpBridge::discard(frameReader &reader, int count)
+{
+  stats.rejectedBytes += count < reader.length ? count : reader.length;
+  consume(reader, count);
+}
@@ -0,0 +1,69 @@
+/*
+  HeatPumpBridge.h - CN105 frames between a remote controller and the heat pump
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpBridge_H__
+#define __HeatPumpBridge_H__
+#include "HeatPump.h"
+#include "HeatPumpTransport.h"
+
+// Forwards CN105 frames between a client (e.g. a TCP connection from a central controller) and the heat pump.
+// Only whole frames with a valid checksum are passed on, each in one write, so the stream on both sides is a
+// plain sequence of CN105 frames; a byte that breaks a frame is dropped and the frame is looked for again from the
+// next one, as HeatPump does (HeatPump::checkFrame()). Requests go to the heat pump one at a time: the next frame from the client
+// waits until the heat pump has answered (or REPLY_TIMEOUT_MS has passed) and the line has been quiet for
+// GAP_MS, and nothing more is read from the client meanwhile, so a fast client is held back by its own TCP window.
+class HeatPumpBridge
+{
+  public:
+    struct Stats {
+      uint32_t framesToUnit;
+      uint32_t framesFromUnit;
+      uint32_t rejectedBytes; // bytes that were not part of a valid frame, from either side
+      uint32_t replyTimeouts; // requests the heat pump did not answer
+    };
+
+    HeatPumpBridge(HeatPumpTransport *unit, HeatPumpTransport *client);
+    // opens the heat pump's line at this bitrate, e.g. the one HeatPump last connected at; the client's CONNECT
+    // is passed on like any other frame, the bridge does not follow a bitrate it negotiates
+    void begin(int bitrate);
+    void loop();             // non-blocking, call as often as possible while a client is attached
+    Stats getStats();
+    void resetStats();
+
+  private:
+    static const unsigned long FRAME_TIMEOUT_MS = 500;     // a started frame must be complete by then
+    static const unsigned long REPLY_TIMEOUT_MS = 500;
+    static const unsigned long GAP_MS = 50;
+
+    struct frameReader {
+      byte buffer[HeatPump::FRAME_MAX_LEN];
+      int length;
+      unsigned long startedAt;
+    };
+
+    HeatPumpTransport *unit;
+    HeatPumpTransport *client;
+    frameReader fromUnit {};
+    frameReader fromClient {};
+    int requestHeld = 0; // length of the complete frame at the start of fromClient waiting for the line, 0 if none
+    bool awaitingReply = false;
+    unsigned long requestSentAt = 0;
+    unsigned long lastUnitFrameAt = 0;
+    Stats stats {};
+
+    int readFrame(HeatPumpTransport *from, frameReader &reader);
+    void consume(frameReader &reader, int count);
+    void discard(frameReader &reader, int count);
+};
+#endif
@@ -0,0 +1,138 @@
+/*
+  HeatPumpManager.cpp - several Mitsubishi Heat Pumps on one board
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "HeatPumpManager.h"
+
+HeatPumpManager::HeatPumpManager()
+{
+}
+
+HeatPumpManager::~HeatPumpManager()
+{
+  for (int i = 0; i < unitCount; i++)
+  {
+    if (units[i].owned)
+    {
+      delete units[i].heatPump;
+    }
+  }
+}
+
+int HeatPumpManager::addUnit(HeatPump *heatPump)
+{
+  if (unitCount >= MAX_UNITS)
+  {
+    return -1;
+  }
+
+  managedUnit &unit = units[unitCount];
+  unit.owned = heatPump == nullptr;
+  unit.heatPump = unit.owned ? new HeatPump() : heatPump;
+  unit.autoReconnect = true;
+  unit.retries = 0;
+  unit.lastConnectAt = 0;
+  return unitCount++;
+}
+
+int HeatPumpManager::getUnitCount()
+{
+  return unitCount;
+}
+
+HeatPump *HeatPumpManager::getUnit(int index)
+{
+  return index >= 0 && index < unitCount ? units[index].heatPump : nullptr;
+}
+
+void HeatPumpManager::setAutoReconnect(int index, bool enabled)
+{
+  if (index >= 0 && index < unitCount)
+  {
+    units[index].autoReconnect = enabled;
+  }
+}
+
+bool HeatPumpManager::getAutoReconnect(int index)
+{
+  return index >= 0 && index < unitCount && units[index].autoReconnect;
+}
+
+void HeatPumpManager::setMaxPolling(int units)
+{
+  maxPolling = units < 0 ? 0 : units;
+}
+
+void HeatPumpManager::sync()
+{
+  int polling = 0;
+  for (int i = 0; i < unitCount; i++)
+  {
+    if (units[i].heatPump->isConnected() && units[i].heatPump->isAwaitingReply())
+    {
+      polling++;
+    }
+  }
+
+  for (int n = 0; n < unitCount; n++)
+  {
+    int i = (nextUnit + n) % unitCount;
+    managedUnit &unit = units[i];
+    HeatPump &heatPump = *unit.heatPump;
+
+    if (heatPump.isConnected())
+    {
+      unit.retries = 0;
+      bool mayPoll = (maxPolling == 0 || polling < maxPolling) && !heatPump.isAwaitingReply();
+      if (!mayPoll)
+      {
+        heatPump.sync(HeatPump::PACKET_TYPE_NO_POLL);
+        continue;
+      }
+      heatPump.sync();
+      if (heatPump.isAwaitingReply())
+      {
+        polling++;
+        nextUnit = (i + 1) % unitCount; // round robin, the others poll first next time
+      }
+    }
+    else if (unit.autoReconnect)
+    {
+      reconnect(unit);
+    }
+  }
+}
+
+// Advance a running handshake, or start a new one once the backoff has passed.
+void HeatPumpManager::reconnect(managedUnit &unit)
+{
+  if (unit.heatPump->isConnecting())
+  {
+    unit.heatPump->sync();
+    return;
+  }
+
+  if (unit.lastConnectAt != 0 && millis() - unit.lastConnectAt < (RECONNECT_INTERVAL_MS << unit.retries))
+  {
+    return;
+  }
+  unit.lastConnectAt = millis();
+  if (unit.retries < RECONNECT_MAX_RETRIES)
+  {
+    unit.retries++;
+  }
+  unit.heatPump->sync(); // starts the handshake
+}
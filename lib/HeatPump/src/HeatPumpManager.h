@@ -0,0 +1,60 @@
+/*
+  HeatPumpManager.h - several Mitsubishi Heat Pumps on one board
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpManager_H__
+#define __HeatPumpManager_H__
+#include "HeatPump.h"
+
+// Drives up to MAX_UNITS HeatPump instances, each on its own CN105 port, from one sync() call.
+// Every unit has its own line, so by default each one polls at its own pace, as a single HeatPump does.
+// setMaxPolling() limits how many units have a poll request on the wire at a time, taking turns, for units that
+// share a line (e.g. behind one bridge) or a loop() too busy for every burst of replies at once.
+// The manager itself only keeps the pointer and the reconnect backoff per unit, but every unit is a whole
+// HeatPump with its own buffers, see HEATPUMP_COMMAND_QUEUE_LEN and friends in HeatPump.h to size them.
+class HeatPumpManager
+{
+  public:
+    static const int MAX_UNITS = 4;
+
+    HeatPumpManager();
+    ~HeatPumpManager();
+
+    int addUnit(HeatPump *heatPump = nullptr); // index of the unit, -1 when full; nullptr creates (and owns) a new HeatPump
+    int getUnitCount();
+    HeatPump *getUnit(int index); // nullptr for an invalid index
+    void setAutoReconnect(int index, bool enabled); // on by default, off leaves connecting to the caller
+    bool getAutoReconnect(int index);
+    void setMaxPolling(int units); // units that may wait for a poll reply at the same time, 0 (the default) for no limit
+
+    void sync(); // call from loop() instead of HeatPump::sync() for every unit
+
+  private:
+    static const unsigned long RECONNECT_INTERVAL_MS = 1000; // doubled for every failed attempt
+    static const int RECONNECT_MAX_RETRIES = 10;             // up to about 17 minutes between attempts
+
+    struct managedUnit {
+      HeatPump *heatPump;
+      bool owned;
+      bool autoReconnect;
+      byte retries;
+      unsigned long lastConnectAt; // millis() of the last handshake started here, 0 if none
+    };
+    managedUnit units[MAX_UNITS];
+    int unitCount = 0;
+    int nextUnit = 0; // gets the first chance to poll
+    int maxPolling = 0; // 0: no limit
+
+    void reconnect(managedUnit &unit);
+};
+#endif
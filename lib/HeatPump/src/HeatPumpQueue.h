@@ -0,0 +1,99 @@
+/*
+  HeatPumpQueue.h - bounded single producer, single consumer queue
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpQueue_H__
+#define __HeatPumpQueue_H__
+#include <stdint.h>
+#if defined(ESP32)
+#include <atomic>
+#endif
+
+// Ring index shared by the two ends of a HeatPumpQueue. Only the ESP32 runs them on different cores, see
+// HeatPumpWorker; elsewhere both ends are called from loop() and a plain variable will do.
+#if defined(ESP32)
+class HeatPumpQueueIndex
+{
+  public:
+    unsigned int load() const { return value.load(std::memory_order_acquire); }
+    void store(unsigned int index) { value.store(index, std::memory_order_release); }
+
+  private:
+    std::atomic<unsigned int> value{0};
+};
+#else
+class HeatPumpQueueIndex
+{
+  public:
+    unsigned int load() const { return value; }
+    void store(unsigned int index) { value = index; }
+
+  private:
+    volatile unsigned int value = 0;
+};
+#endif
+
+// Lock-free queue of up to N items between exactly one producer and one consumer, which may run on different
+// cores: push() only writes the tail, pop() only writes the head, and an item is copied in before the tail
+// moves past it (release) and read by the consumer only after it has seen the new tail (acquire).
+// Nothing blocks and nothing is allocated, a full queue makes push() return false.
+template <typename T, unsigned int N>
+class HeatPumpQueue
+{
+  public:
+    bool push(const T &item) // producer only
+    {
+      unsigned int tail = this->tail.load();
+      unsigned int next = advance(tail);
+      if (next == head.load())
+      {
+        return false;
+      }
+      items[tail] = item;
+      this->tail.store(next);
+      return true;
+    }
+
+    bool pop(T &item) // consumer only
+    {
+      unsigned int head = this->head.load();
+      if (head == tail.load())
+      {
+        return false;
+      }
+      item = items[head];
+      this->head.store(advance(head));
+      return true;
+    }
+
+    bool isFull() const // producer only, the consumer can only make room meanwhile
+    {
+      return advance(tail.load()) == head.load();
+    }
+
+    bool isEmpty() const // consumer only, the producer can only add items meanwhile
+    {
+      return head.load() == tail.load();
+    }
+
+  private:
+    T items[N + 1]; // one slot always stays free, so a full queue can be told from an empty one
+    HeatPumpQueueIndex head; // next item to pop, written by the consumer
+    HeatPumpQueueIndex tail; // next slot to push into, written by the producer
+
+    static unsigned int advance(unsigned int index)
+    {
+      return index == N ? 0 : index + 1;
+    }
+};
+#endif
@@ -0,0 +1,117 @@
+/*
+  HeatPumpTransport.cpp - byte streams the CN105 frames of HeatPump go over
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "HeatPumpTransport.h"
+
+static const unsigned long SERIAL_READ_TIMEOUT_MS = 500; // only matters for a blocking read, HeatPump never does one
+
+#if defined(__WIFIKITSAMD__)
+
+HeatPumpSerialTransport::HeatPumpSerialTransport(Uart *serial) : serial(serial)
+{
+}
+
+void HeatPumpSerialTransport::setSerial(Uart *serial)
+{
+  this->serial = serial;
+}
+
+#else
+
+HeatPumpSerialTransport::HeatPumpSerialTransport(HardwareSerial *serial, int rx, int tx)
+    : serial(serial), rxPin(rx), txPin(tx)
+{
+}
+
+void HeatPumpSerialTransport::setSerial(HardwareSerial *serial)
+{
+  this->serial = serial;
+}
+
+void HeatPumpSerialTransport::setPins(int rx, int tx)
+{
+  rxPin = rx;
+  txPin = tx;
+}
+
+#endif
+
+void HeatPumpSerialTransport::begin(int bitrate)
+{
+  #if defined(__WIFIKITSAMD__)
+  serial->begin(bitrate, SERIAL_8E1);
+  pinPeripheral(10, PIO_SERCOM);
+  pinPeripheral(11, PIO_SERCOM);
+  #elif defined(ESP32)
+  if (rxPin >= 0 && txPin >= 0)
+  {
+    serial->begin(bitrate, SERIAL_8E1, rxPin, txPin);
+  }
+  else
+  {
+    serial->begin(bitrate, SERIAL_8E1);
+  }
+  #else
+  serial->begin(bitrate, SERIAL_8E1);
+  #endif
+
+  serial->setTimeout(SERIAL_READ_TIMEOUT_MS);
+}
+
+int HeatPumpSerialTransport::available()
+{
+  return serial->available();
+}
+
+int HeatPumpSerialTransport::read()
+{
+  return serial->read();
+}
+
+size_t HeatPumpSerialTransport::write(const uint8_t *data, size_t length)
+{
+  return serial->write(data, length);
+}
+
+HeatPumpStreamTransport::HeatPumpStreamTransport(Stream *stream) : stream(stream)
+{
+}
+
+void HeatPumpStreamTransport::setStream(Stream *stream)
+{
+  this->stream = stream;
+}
+
+void HeatPumpStreamTransport::begin(int bitrate)
+{
+  (void)bitrate; // a stream has no line speed, whoever opened it set one up if there is any
+}
+
+int HeatPumpStreamTransport::available()
+{
+  return stream != nullptr ? stream->available() : 0;
+}
+
+int HeatPumpStreamTransport::read()
+{
+  return stream != nullptr ? stream->read() : -1;
+}
+
+size_t HeatPumpStreamTransport::write(const uint8_t *data, size_t length)
+{
+  return stream != nullptr ? stream->write(data, length) : 0;
+}
@@ -0,0 +1,84 @@
+/*
+  HeatPumpTransport.h - byte streams the CN105 frames of HeatPump go over
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpTransport_H__
+#define __HeatPumpTransport_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <HardwareSerial.h>
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if defined(__WIFIKITSAMD__)
+  #include "wiring_private.h"
+  #include <Uart.h>
+#endif
+
+// HeatPump only needs these four calls, so the A/C can be on a UART, behind a TCP bridge or, when the library is
+// built on a PC, on a pipe or socket. Nothing may block: sync() polls available() and reads what is there.
+class HeatPumpTransport
+{
+  public:
+    virtual ~HeatPumpTransport() {}
+    virtual void begin(int bitrate) = 0; // (re)open the line, called before every connect attempt
+    virtual int available() = 0;         // bytes that can be read right away
+    virtual int read() = 0;              // next byte, -1 if there is none
+    virtual size_t write(const uint8_t *data, size_t length) = 0;
+};
+
+// The CN105 UART: 8 data bits, even parity and one stop bit at the bitrate HeatPump asks for.
+class HeatPumpSerialTransport : public HeatPumpTransport
+{
+  public:
+    #if defined(__WIFIKITSAMD__)
+      HeatPumpSerialTransport(Uart *serial = nullptr);
+      void setSerial(Uart *serial);
+    #else
+      HeatPumpSerialTransport(HardwareSerial *serial = nullptr, int rx = -1, int tx = -1);
+      void setSerial(HardwareSerial *serial);
+      void setPins(int rx, int tx); // ESP32 only, -1 keeps the default pins of the UART
+    #endif
+    void begin(int bitrate) override;
+    int available() override;
+    int read() override;
+    size_t write(const uint8_t *data, size_t length) override;
+
+  private:
+    #if defined(__WIFIKITSAMD__)
+      Uart *serial;
+    #else
+      HardwareSerial *serial;
+    #endif
+    int rxPin = -1;
+    int txPin = -1;
+};
+
+// Any Arduino Stream, e.g. the WiFiClient of a CN105 bridge on the other end. The bitrate is the far end's business.
+class HeatPumpStreamTransport : public HeatPumpTransport
+{
+  public:
+    HeatPumpStreamTransport(Stream *stream = nullptr);
+    void setStream(Stream *stream);
+    void begin(int bitrate) override;
+    int available() override;
+    int read() override;
+    size_t write(const uint8_t *data, size_t length) override;
+
+  private:
+    Stream *stream;
+};
+#endif
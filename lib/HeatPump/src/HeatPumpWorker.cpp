@@ -0,0 +1,641 @@
+/*
+  HeatPumpWorker.cpp - the CN105 side of a sketch in its own task, behind queues
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "HeatPumpWorker.h"
+
+HeatPumpWorker::HeatPumpWorker(HeatPumpManager *manager) : manager(manager)
+{
+}
+
+bool HeatPumpWorker::begin(int core)
+{
+#if HEATPUMP_WORKER_TASK
+  // the results are kept on the CN105 side and handed to the result callback by loop()
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    manager->getUnit(i)->setUpdateResultCallback([this, i](unsigned int sequence, int result) {
+      Result &pending = pendingResults[i];
+      if (pending.valid)
+      {
+        droppedResults[i]++; // only the latest one counts, e.g. for a sketch waiting for its last change
+      }
+      pending = {(byte)i, true, sequence, result};
+      forwardResult(i);
+    });
+  }
+
+  // the first snapshots before anything runs on the other core, so getState() starts from the connect() done
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    publishState(i);
+  }
+  takeStates();
+
+#if defined(ESP32)
+  if (!threaded && core >= 0 && core < portNUM_PROCESSORS)
+  {
+    threaded = xTaskCreatePinnedToCore(taskMain, "heatpump", TASK_STACK_SIZE, this, TASK_PRIORITY, nullptr, core) == pdPASS;
+  }
+#else
+  (void)core;
+#endif
+#else
+  (void)core; // no task to run in
+#if defined(ESP8266) || defined(ESP32)
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    manager->getUnit(i)->setUpdateResultCallback([this, i](unsigned int sequence, int result) {
+      if (resultCallback)
+      {
+        resultCallback(i, sequence, result); // from dispatchEvents() in loop()
+      }
+    });
+  }
+#endif
+#endif
+  return threaded;
+}
+
+bool HeatPumpWorker::isThreaded()
+{
+  return threaded;
+}
+
+#if HEATPUMP_WORKER_TASK
+#if defined(ESP32)
+void HeatPumpWorker::taskMain(void *worker)
+{
+  TickType_t pause = pdMS_TO_TICKS(STEP_INTERVAL_MS);
+  for (;;)
+  {
+    static_cast<HeatPumpWorker *>(worker)->step();
+    vTaskDelay(pause > 0 ? pause : 1); // always block, the idle task of this core feeds the watchdog
+  }
+}
+#endif
+
+void HeatPumpWorker::loop()
+{
+  if (!threaded)
+  {
+    step();
+  }
+
+  takeStates();
+  detailsQueue.pop(details);
+
+  Result result;
+  while (results.pop(result))
+  {
+    if (resultCallback)
+    {
+      resultCallback(result.unit, result.sequence, result.result);
+    }
+  }
+}
+
+void HeatPumpWorker::takeStates()
+{
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    State state;
+    if (!stateQueues[i].pop(state))
+    {
+      continue;
+    }
+    for (int field = 0; field < HeatPump::STATE_FIELD_COUNT; field++)
+    {
+      if (state.changed & (1 << field))
+      {
+        fieldSequence[i][field] = state.stateSequence;
+      }
+    }
+    states[i] = state;
+  }
+}
+
+// CN105 side: the queued commands first, so a change goes out with this sync(), then publish what it found
+void HeatPumpWorker::step()
+{
+  Command command;
+  while (commands.pop(command))
+  {
+    heatpumpFunctions functions;
+    if (command.type == CMD_FUNCTIONS && functionsQueue.pop(functions))
+    {
+      apply(command, &functions);
+    }
+    else
+    {
+      apply(command, nullptr);
+    }
+  }
+
+  manager->sync();
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    HeatPump *unit = manager->getUnit(i);
+    if (!detached[i] && !manager->getAutoReconnect(i) && unit->isConnecting())
+    {
+      unit->sync(); // the handshake of a unit the sketch connects itself, the manager leaves it alone
+    }
+    unit->dispatchEvents();
+    forwardResult(i);
+    forwardTraces(i);
+    publishState(i);
+  }
+  publishDetails();
+}
+#else
+void HeatPumpWorker::loop()
+{
+  step();
+}
+
+void HeatPumpWorker::step()
+{
+  manager->sync();
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    HeatPump *unit = manager->getUnit(i);
+    if (!detached[i] && !manager->getAutoReconnect(i) && unit->isConnecting())
+    {
+      unit->sync(); // the handshake of a unit the sketch connects itself, the manager leaves it alone
+    }
+    unit->dispatchEvents();
+  }
+}
+#endif
+
+void HeatPumpWorker::apply(const Command &command, const heatpumpFunctions *functions)
+{
+  HeatPump *unit = manager->getUnit(command.unit);
+  if (unit == nullptr)
+  {
+    return;
+  }
+  applied[command.unit] = command.sequence;
+
+  switch (command.type)
+  {
+  case CMD_SETTINGS:
+    if (command.fields & HeatPump::FIELD_POWER)
+    {
+      unit->setPowerSetting(command.settings.power);
+    }
+    if (command.fields & HeatPump::FIELD_MODE)
+    {
+      unit->setModeSetting(command.settings.mode);
+    }
+    if (command.fields & HeatPump::FIELD_TEMPERATURE)
+    {
+      unit->setTemperature(command.value);
+    }
+    if (command.fields & HeatPump::FIELD_FAN)
+    {
+      unit->setFanSpeed(command.settings.fan);
+    }
+    if (command.fields & HeatPump::FIELD_VANE)
+    {
+      unit->setVaneSetting(command.settings.vane);
+    }
+    if (command.fields & HeatPump::FIELD_WIDEVANE)
+    {
+      unit->setWideVaneSetting(command.settings.wideVane);
+    }
+    break;
+  case CMD_INFO_MODE:
+    unit->setInfoModeIndex(command.index);
+    break;
+  case CMD_REMOTE_TEMP:
+    unit->streamRemoteTemperature(command.value);
+    break;
+  case CMD_FUNCTIONS:
+    if (functions != nullptr)
+    {
+      unit->setFunctions(*functions);
+    }
+    break;
+  case CMD_REQUEST_FUNCTIONS:
+    unit->requestFunctions();
+    break;
+  case CMD_CUSTOM_PACKET:
+  {
+    byte data[CUSTOM_PACKET_LEN];
+    memcpy(data, command.data, command.length);
+    unit->sendCustomPacket(data, command.length);
+    break;
+  }
+  case CMD_TRACE:
+    unit->setTraceEnabled(command.enabled);
+    break;
+  case CMD_RESET_STATS:
+    unit->resetBusStats();
+    break;
+  case CMD_CONNECT:
+    detached[command.unit] = false;
+    unit->connect(static_cast<HeatPumpTransport *>(nullptr));
+    break;
+  case CMD_DISCONNECT:
+    unit->disconnect();
+    detached[command.unit] = true;
+    break;
+  }
+}
+
+void HeatPumpWorker::readState(int index, State &state)
+{
+  HeatPump *unit = manager->getUnit(index);
+  state.connected = unit->isConnected();
+  state.connecting = unit->isConnecting();
+  state.detached = detached[index];
+  state.linkState = unit->getLinkState();
+  state.sendPending = unit->sendPending();
+  state.probing = unit->isProbing();
+  state.fetchingFunctions = unit->isFetchingFunctions();
+  state.functionsStale = unit->isFunctionsStale(~0UL);
+  state.capabilities = unit->getCapabilities();
+  state.preferredBitrate = unit->getPreferredBitrate();
+  state.functionsReadAt = unit->getFunctionsReadAt();
+  state.stateSequence = unit->getStateSequence();
+  state.commandSequence = applied[index];
+}
+
+void HeatPumpWorker::readDetails(Details &snapshot)
+{
+  HeatPump *unit = manager->getUnit(0);
+  snapshot = {};
+  snapshot.takenAt = millis();
+  snapshot.busStats = unit->getBusStats();
+  snapshot.timing = unit->getTimingProfile();
+  snapshot.responseWaitMs = unit->getResponseWaitMs();
+  for (int i = 0; i < HeatPump::REGISTER_COUNT; i++)
+  {
+    const byte *reg = unit->getRegister(HeatPump::REGISTER_COMMANDS[i]);
+    if (reg != nullptr)
+    {
+      memcpy(snapshot.registers[i], reg, HeatPump::REGISTER_LEN);
+      snapshot.registersValid |= 1 << i;
+    }
+  }
+}
+
+#if HEATPUMP_WORKER_TASK
+// Push a new snapshot of the unit once the network side has taken the last one and something has changed.
+void HeatPumpWorker::publishState(int index)
+{
+  if (stateQueues[index].isFull())
+  {
+    return;
+  }
+
+  HeatPump *unit = manager->getUnit(index);
+  State &last = published[index];
+  State state = {};
+  readState(index, state);
+  state.droppedResults = droppedResults[index];
+  state.changed = unit->getChangedSince(last.stateSequence);
+  if (state.changed == 0 && sameFlags(state, last))
+  {
+    return;
+  }
+  state.settings = unit->getSettings();
+  state.status = unit->getStatus();
+  state.functions = unit->getFunctions();
+
+  stateQueues[index].push(state);
+  last = state;
+}
+
+bool HeatPumpWorker::sameFlags(const State &a, const State &b)
+{
+  return a.connected == b.connected && a.connecting == b.connecting && a.detached == b.detached &&
+         a.linkState == b.linkState && a.sendPending == b.sendPending && a.probing == b.probing &&
+         a.fetchingFunctions == b.fetchingFunctions && a.functionsStale == b.functionsStale &&
+         a.capabilities == b.capabilities && a.preferredBitrate == b.preferredBitrate &&
+         a.functionsReadAt == b.functionsReadAt && a.commandSequence == b.commandSequence &&
+         a.droppedResults == b.droppedResults;
+}
+
+void HeatPumpWorker::publishDetails()
+{
+  if (manager->getUnitCount() == 0 || millis() - detailsAt < DETAILS_INTERVAL_MS || detailsQueue.isFull())
+  {
+    return;
+  }
+
+  Details snapshot;
+  readDetails(snapshot);
+  detailsQueue.push(snapshot);
+  detailsAt = snapshot.takenAt;
+}
+
+// The latest result of the unit stays pending while the queue is full, see begin()
+void HeatPumpWorker::forwardResult(int index)
+{
+  if (pendingResults[index].valid && results.push(pendingResults[index]))
+  {
+    pendingResults[index].valid = false;
+  }
+}
+
+// Frames stay in the unit's own ring while the queue is full, which drops the oldest ones as usual
+void HeatPumpWorker::forwardTraces(int index)
+{
+#if HEATPUMP_TRACE_FRAMES > 0
+  TraceItem item;
+  item.unit = index;
+  while (!traces.isFull() && manager->getUnit(index)->popTrace(item.entry))
+  {
+    traces.push(item);
+  }
+#else
+  (void)index;
+#endif
+}
+#endif
+
+// Without the task the command is applied right away, on the network side which is then the CN105 side as well
+bool HeatPumpWorker::post(Command &command, int unit, const heatpumpFunctions *functions)
+{
+  if (unit < 0 || unit >= manager->getUnitCount())
+  {
+    return false;
+  }
+  command.unit = unit;
+  command.sequence = posted[unit] + 1;
+#if HEATPUMP_WORKER_TASK
+  // producer side checks, the CN105 side can only make room meanwhile
+  if (commands.isFull() || (functions != nullptr && functionsQueue.isFull()))
+  {
+    droppedCommands++;
+    return false;
+  }
+  if (functions != nullptr)
+  {
+    functionsQueue.push(*functions);
+  }
+  commands.push(command);
+#else
+  apply(command, functions);
+#endif
+  posted[unit] = command.sequence;
+  return true;
+}
+
+bool HeatPumpWorker::setPowerSetting(int unit, HeatPump::Power setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_POWER;
+  command.settings.power = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setModeSetting(int unit, HeatPump::Mode setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_MODE;
+  command.settings.mode = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setTemperature(int unit, float setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_TEMPERATURE;
+  command.value = setting; // rounded by HeatPump::setTemperature()
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setFanSpeed(int unit, HeatPump::Fan setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_FAN;
+  command.settings.fan = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setVaneSetting(int unit, HeatPump::Vane setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_VANE;
+  command.settings.vane = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setWideVaneSetting(int unit, HeatPump::WideVane setting)
+{
+  Command command {};
+  command.type = CMD_SETTINGS;
+  command.fields = HeatPump::FIELD_WIDEVANE;
+  command.settings.wideVane = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setInfoModeIndex(int unit, int index)
+{
+  Command command {};
+  command.type = CMD_INFO_MODE;
+  command.index = index;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::streamRemoteTemperature(int unit, float setting)
+{
+  Command command {};
+  command.type = CMD_REMOTE_TEMP;
+  command.value = setting;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setFunctions(int unit, const heatpumpFunctions &functions)
+{
+  if (!functions.isValid())
+  {
+    return false;
+  }
+  Command command {};
+  command.type = CMD_FUNCTIONS;
+  return post(command, unit, &functions);
+}
+
+bool HeatPumpWorker::requestFunctions(int unit)
+{
+  Command command {};
+  command.type = CMD_REQUEST_FUNCTIONS;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::sendCustomPacket(int unit, const byte *data, int length)
+{
+  if (length < 1 || length > CUSTOM_PACKET_LEN)
+  {
+    return false;
+  }
+  Command command {};
+  command.type = CMD_CUSTOM_PACKET;
+  command.length = length;
+  memcpy(command.data, data, length);
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::setTraceEnabled(int unit, bool enabled)
+{
+  Command command {};
+  command.type = CMD_TRACE;
+  command.enabled = enabled;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::resetBusStats(int unit)
+{
+  Command command {};
+  command.type = CMD_RESET_STATS;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::connect(int unit)
+{
+  Command command {};
+  command.type = CMD_CONNECT;
+  return post(command, unit);
+}
+
+bool HeatPumpWorker::disconnect(int unit)
+{
+  Command command {};
+  command.type = CMD_DISCONNECT;
+  return post(command, unit);
+}
+
+uint32_t HeatPumpWorker::getCommandSequence(int unit)
+{
+  return unit >= 0 && unit < MAX_UNITS ? posted[unit] : 0;
+}
+
+int HeatPumpWorker::getUnitCount()
+{
+  return manager->getUnitCount(); // only changes in setup(), before begin()
+}
+
+#if HEATPUMP_WORKER_TASK
+const HeatPumpWorker::State &HeatPumpWorker::getState(int unit)
+{
+  return states[unit >= 0 && unit < MAX_UNITS ? unit : 0];
+}
+
+uint16_t HeatPumpWorker::getChangedSince(int unit, uint32_t sequence)
+{
+  if (unit < 0 || unit >= MAX_UNITS)
+  {
+    return 0;
+  }
+  uint16_t fields = 0;
+  for (int i = 0; i < HeatPump::STATE_FIELD_COUNT; i++)
+  {
+    if (fieldSequence[unit][i] > sequence)
+    {
+      fields |= 1 << i;
+    }
+  }
+  return fields;
+}
+
+const HeatPumpWorker::Details &HeatPumpWorker::getDetails()
+{
+  return details;
+}
+
+bool HeatPumpWorker::popTrace(int &unit, HeatPump::TraceEntry &entry)
+{
+#if HEATPUMP_TRACE_FRAMES > 0
+  TraceItem item;
+  if (!traces.pop(item))
+  {
+    return false;
+  }
+  unit = item.unit;
+  entry = item.entry;
+  return true;
+#else
+  (void)unit;
+  (void)entry;
+  return false;
+#endif
+}
+#else
+const HeatPumpWorker::State &HeatPumpWorker::getState(int unit)
+{
+  if (unit < 0 || unit >= manager->getUnitCount())
+  {
+    unit = 0;
+  }
+  current = {};
+  if (manager->getUnitCount() > 0)
+  {
+    HeatPump *heatPump = manager->getUnit(unit);
+    readState(unit, current);
+    current.settings = heatPump->getSettings();
+    current.status = heatPump->getStatus();
+    current.functions = heatPump->getFunctions();
+  }
+  return current;
+}
+
+uint16_t HeatPumpWorker::getChangedSince(int unit, uint32_t sequence)
+{
+  HeatPump *heatPump = manager->getUnit(unit);
+  return heatPump != nullptr ? heatPump->getChangedSince(sequence) : 0;
+}
+
+const HeatPumpWorker::Details &HeatPumpWorker::getDetails()
+{
+  if (manager->getUnitCount() > 0)
+  {
+    readDetails(details);
+  }
+  return details;
+}
+
+bool HeatPumpWorker::popTrace(int &unit, HeatPump::TraceEntry &entry)
+{
+  for (int i = 0; i < manager->getUnitCount(); i++)
+  {
+    if (manager->getUnit(i)->popTrace(entry))
+    {
+      unit = i;
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+void HeatPumpWorker::setUpdateResultCallback(heatpumpWorkerResultCallback callback)
+{
+  resultCallback = callback;
+}
+
+unsigned int HeatPumpWorker::getDroppedCommands()
+{
+  return droppedCommands;
+}
@@ -0,0 +1,215 @@
+/*
+  HeatPumpWorker.h - the CN105 side of a sketch in its own task, behind queues
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpWorker_H__
+#define __HeatPumpWorker_H__
+#include "HeatPump.h"
+#include "HeatPumpManager.h"
+#include "HeatPumpQueue.h"
+
+#if defined(ESP8266) || defined(ESP32)
+typedef std::function<void(int unit, unsigned int sequence, int result)> heatpumpWorkerResultCallback;
+#else
+typedef void (*heatpumpWorkerResultCallback)(int unit, unsigned int sequence, int result);
+#endif
+
+// 1 builds the queues and snapshots that let begin() move the CN105 side to a task of its own, 0 leaves them
+// out and the worker calls the units directly from loop(). Only a dual core ESP32 can use the task.
+#ifndef HEATPUMP_WORKER_TASK
+#if defined(ESP32) && !CONFIG_FREERTOS_UNICORE
+#define HEATPUMP_WORKER_TASK 1
+#else
+#define HEATPUMP_WORKER_TASK 0
+#endif
+#endif
+
+// Runs the units of a HeatPumpManager for a sketch whose loop() also does the network work.
+// On a dual core ESP32 begin() moves the CN105 side into a FreeRTOS task pinned to the given core, so a slow TLS
+// handshake, upload or MQTT reconnect no longer delays the polling, and polling no longer delays the network.
+// The two sides then only share bounded lock-free queues, one producer and one consumer each:
+//  - commands (the setters below) go to the CN105 side, which applies them before its next sync();
+//  - every unit's State goes back through a one-slot queue: a new snapshot is published once the previous one
+//    has been taken, with the changes made meanwhile, so neither side waits and no change is lost;
+//  - update results, the packet trace and the first unit's Details (bus counters etc.) have queues of their own.
+// Built without the task (HEATPUMP_WORKER_TASK 0, the ESP8266 and single core chips) there are no queues or
+// copies: loop() syncs the units, the setters call them right away and getState()/getDetails() read them.
+// After begin() the sketch must not call the units directly any more, only the worker.
+class HeatPumpWorker
+{
+  public:
+    static const int MAX_UNITS = HeatPumpManager::MAX_UNITS;
+    static const int COMMAND_QUEUE_LEN = 8;
+    static const int RESULT_QUEUE_LEN = 4;
+    static const unsigned long STEP_INTERVAL_MS = 2;    // pause of the task between two sync()s
+    static const unsigned long DETAILS_INTERVAL_MS = 1000; // Details are published at most this often
+    static const uint32_t TASK_STACK_SIZE = 4096;
+    static const int TASK_PRIORITY = 1; // the same as loop(), the cores are not shared
+
+    // a unit as seen by the CN105 side, see getState()
+    struct State {
+      bool connected;
+      bool connecting;
+      bool detached;          // disconnect() has been done, the unit is left alone until connect()
+      byte linkState;         // LINK_*
+      bool sendPending;
+      bool probing;
+      bool fetchingFunctions;
+      bool functionsStale;    // never read or possibly changed since, the age is up to the caller (functionsReadAt)
+      uint16_t capabilities;
+      int preferredBitrate;
+      uint32_t stateSequence;
+      uint16_t changed;       // STATE_* bits changed since the previous snapshot, see getChangedSince()
+      uint32_t commandSequence; // the last command applied to this unit, see getCommandSequence()
+      uint32_t droppedResults;  // update results replaced by a newer one before loop() took them
+      heatpumpSettings settings;
+      heatpumpStatus status;
+      heatpumpFunctions functions;
+      unsigned long functionsReadAt;
+    };
+
+    // the first unit's counters, timing and registers, see getDetails()
+    struct Details {
+      unsigned long takenAt; // millis() of the snapshot, 0 before the first one
+      HeatPump::BusStats busStats;
+      HeatPump::TimingProfile timing;
+      unsigned long responseWaitMs;
+      byte registersValid; // bit i set if registers[i] holds a reply to REGISTER_COMMANDS[i]
+      byte registers[HeatPump::REGISTER_COUNT][HeatPump::REGISTER_LEN];
+    };
+
+    explicit HeatPumpWorker(HeatPumpManager *manager);
+    // call after the units have been added and connected; true if the CN105 side now runs in its own task
+    bool begin(int core = -1);
+    bool isThreaded();
+    void loop(); // call from loop(): runs the CN105 side unless it has its own task, then takes what it published
+
+    // network side, each queues one command and returns false if the queue is full
+    bool setPowerSetting(int unit, HeatPump::Power setting);
+    bool setModeSetting(int unit, HeatPump::Mode setting);
+    bool setTemperature(int unit, float setting);
+    bool setFanSpeed(int unit, HeatPump::Fan setting);
+    bool setVaneSetting(int unit, HeatPump::Vane setting);
+    bool setWideVaneSetting(int unit, HeatPump::WideVane setting);
+    bool setInfoModeIndex(int unit, int index); // ask for that info next, e.g. RQST_PKT_SETTINGS after a change
+    bool streamRemoteTemperature(int unit, float setting);
+    bool setFunctions(int unit, const heatpumpFunctions &functions); // one at a time, false until the last one is applied
+    bool requestFunctions(int unit);
+    bool sendCustomPacket(int unit, const byte *data, int length);
+    bool setTraceEnabled(int unit, bool enabled);
+    bool resetBusStats(int unit);
+    bool connect(int unit);    // new handshake on the same transport, for units without auto reconnect
+    bool disconnect(int unit); // let go of the line, e.g. before a CN105 bridge takes over
+    // the last command queued for the unit; it has been applied once State::commandSequence has reached it, e.g.
+    // State::detached only confirms a disconnect() in a snapshot that does
+    uint32_t getCommandSequence(int unit);
+
+    // network side, what the CN105 side published last
+    int getUnitCount();
+    // zeroed until the first snapshot, unit 0 for an invalid index. Without the task it is read from the unit on
+    // every call and only valid until the next getState()
+    const State &getState(int unit);
+    uint16_t getChangedSince(int unit, uint32_t sequence); // as HeatPump::getChangedSince(), at snapshot granularity
+    const Details &getDetails();
+    bool popTrace(int &unit, HeatPump::TraceEntry &entry); // frames of every unit with the trace enabled, oldest first
+    void setUpdateResultCallback(heatpumpWorkerResultCallback callback); // called from loop()
+    unsigned int getDroppedCommands(); // commands refused because the queue was full
+
+  private:
+    static const int CUSTOM_PACKET_LEN = 20; // data bytes sendCustomPacket() takes at most
+    struct Command {
+      byte type;
+      byte unit;
+      uint32_t sequence;
+      byte fields; // CMD_SETTINGS: FIELD_* bits of settings to apply
+      HeatPump::Settings settings;
+      float value;
+      int index;
+      bool enabled;
+      byte length;
+      byte data[CUSTOM_PACKET_LEN];
+    };
+    static const byte CMD_SETTINGS = 1;
+    static const byte CMD_INFO_MODE = 2;
+    static const byte CMD_REMOTE_TEMP = 3;
+    static const byte CMD_FUNCTIONS = 4; // the functions themselves wait in functionsQueue
+    static const byte CMD_REQUEST_FUNCTIONS = 5;
+    static const byte CMD_CUSTOM_PACKET = 6;
+    static const byte CMD_TRACE = 7;
+    static const byte CMD_RESET_STATS = 8;
+    static const byte CMD_CONNECT = 9;
+    static const byte CMD_DISCONNECT = 10;
+
+    HeatPumpManager *manager;
+    bool threaded = false;
+    heatpumpWorkerResultCallback resultCallback {nullptr};
+    unsigned int droppedCommands = 0;
+    uint32_t posted[MAX_UNITS] = {}; // sequence of the last command queued per unit
+    bool detached[MAX_UNITS] = {};   // CN105 side
+    uint32_t applied[MAX_UNITS] = {}; // CN105 side, sequence of the last command applied per unit
+
+#if HEATPUMP_WORKER_TASK
+    struct Result {
+      byte unit;
+      bool valid; // pendingResults only
+      unsigned int sequence;
+      int result;
+    };
+    struct TraceItem {
+      byte unit;
+      HeatPump::TraceEntry entry;
+    };
+
+    // one end of each queue on either side
+    HeatPumpQueue<Command, COMMAND_QUEUE_LEN> commands; // to the CN105 side
+    HeatPumpQueue<heatpumpFunctions, 1> functionsQueue; // of CMD_FUNCTIONS, too big for every command
+    HeatPumpQueue<State, 1> stateQueues[MAX_UNITS];     // the others from it
+    HeatPumpQueue<Details, 1> detailsQueue;
+    HeatPumpQueue<Result, RESULT_QUEUE_LEN> results;
+#if HEATPUMP_TRACE_FRAMES > 0
+    HeatPumpQueue<TraceItem, HEATPUMP_TRACE_FRAMES> traces;
+#endif
+
+    // network side only
+    State states[MAX_UNITS] = {};
+    uint32_t fieldSequence[MAX_UNITS][HeatPump::STATE_FIELD_COUNT] = {}; // stateSequence of the snapshot that changed each field
+    Details details = {};
+
+    // CN105 side only
+    State published[MAX_UNITS] = {}; // last snapshot pushed per unit
+    Result pendingResults[MAX_UNITS] = {}; // the latest result per unit while the queue is full
+    uint32_t droppedResults[MAX_UNITS] = {};
+    unsigned long detailsAt = 0;
+
+    void takeStates(); // network side, the snapshots published since the last call
+    void publishState(int index);
+    void publishDetails();
+    void forwardResult(int index);
+    void forwardTraces(int index);
+    static bool sameFlags(const State &a, const State &b);
+#if defined(ESP32)
+    static void taskMain(void *worker);
+#endif
+#else
+    // filled on demand by getState() and getDetails()
+    State current = {};
+    Details details = {};
+#endif
+
+    bool post(Command &command, int unit, const heatpumpFunctions *functions = nullptr);
+    void step(); // the CN105 side
+    void apply(const Command &command, const heatpumpFunctions *functions);
+    void readState(int index, State &state); // CN105 side
+    void readDetails(Details &details);      // CN105 side
+};
+#endif
@@ -26,6 +26,7 @@ const PROGMEM char* unit_conf = "/unit.json";
 const PROGMEM char* console_file = "/console.log";
 const PROGMEM char* others_conf = "/others.json";
 const PROGMEM char* energy_file = "/energy.json";
+const PROGMEM char* cn105_file = "/cn105.json";
 #else
 const PROGMEM char* wifi_conf = "wifi.json";
 const PROGMEM char* mqtt_conf = "mqtt.json";
@@ -33,6 +34,7 @@ const PROGMEM char* unit_conf = "unit.json";
 const PROGMEM char* console_file = "console.log";
 const PROGMEM char* others_conf = "others.json";
 const PROGMEM char* energy_file = "energy.json";
+const PROGMEM char* cn105_file = "cn105.json";
 #endif
 
 // Define global variables for network
@@ -95,6 +97,9 @@ String ha_unit_settings_topic;
 String ha_state_topic;
 String ha_debug_topic;
 String ha_debug_set_topic;
+String ha_diagnostics_topic;
+String ha_functions_topic;
+String ha_functions_set_topic;
 String ha_climate_config_topic;
 String ha_sensor_room_temp_config_topic;
 String ha_sensor_power_config_topic;
@@ -126,9 +131,37 @@ const PROGMEM uint32_t SEND_ROOM_TEMP_INTERVAL_MS = 15000; // 15 seconds (anythi
 const PROGMEM uint32_t POLL_DELAY_AFTER_SET_MS = 35000; // After send command, wait at least 35 seconds for A/C to update status.
 const PROGMEM uint32_t MQTT_RETRY_INTERVAL_MS = 1000; // 1 seconds
 const PROGMEM uint32_t HP_RETRY_INTERVAL_MS = 1000; // 1 seconds
+const PROGMEM uint32_t DIAGNOSTICS_INTERVAL_MS = 60000; // Publish the CN105 bus statistics every 60 seconds
+const PROGMEM uint32_t STATE_HEARTBEAT_INTERVAL_MS = 300000; // Publish the state every 5 minutes even if nothing changed
+const PROGMEM uint32_t FUNCTIONS_REFRESH_INTERVAL_MS = 3600000; // Read the installer functions again after 1 hour
+const PROGMEM uint32_t FUNCTIONS_RETRY_INTERVAL_MS = 60000; // Wait 1 minute before retrying a failed functions read
+
+// Intervals of the tasks run from loop(), see setupTasks(); loop() sleeps until the next one is due
+const PROGMEM uint32_t NETWORK_TASK_MS = 2; // Web server, OTA and incoming MQTT
+const PROGMEM uint32_t HP_TASK_MS = 5; // CN105 polling, the serial reads are paced by the replies anyway
+const PROGMEM uint32_t PUBLISH_TASK_MS = 20; // Publish the changed state
+const PROGMEM uint32_t FUNCTIONS_TASK_MS = 1000; // Check whether the installer functions are stale
+const PROGMEM uint32_t LED_TASK_MS = 20; // LEDs and the button
+const PROGMEM uint32_t WATCHDOG_TASK_MS = 1000; // Watchdog and WiFi timeout
+// Core of the FreeRTOS task that runs the CN105 side (HeatPumpWorker), away from WiFi, MQTT and the web server
+// on the core of loop(). -1 keeps it in loop(); the ESP8266 and single core chips build the worker without the task
+// (HEATPUMP_WORKER_TASK 0) and ignore it.
+#if defined(ESP32) && !CONFIG_FREERTOS_UNICORE
+#define HP_TASK_CORE (1 - ARDUINO_RUNNING_CORE)
+#else
+#define HP_TASK_CORE -1
+#endif
+const float REMOTE_TEMP_DEADBAND = 0.3; // Send a new remote temperature only if it moved by this much (°C)
+const PROGMEM uint32_t REMOTE_TEMP_MIN_INTERVAL_MS = 10000; // Send the remote temperature at most every 10 seconds
+const PROGMEM uint32_t REMOTE_TEMP_REFRESH_MS = 60000; // Send it again every minute so the A/C keeps using it
+const PROGMEM uint32_t REMOTE_TEMP_TIMEOUT_MS = 1800000; // Back to the A/C's own sensor after 30 minutes without a value
 const PROGMEM uint32_t HP_MAX_RETRIES = 10; // Double the interval between retries up to this many times, then keep retrying forever at that maximum interval.
 // Default values give a final retry interval of 1000ms * 2^10, which is 1024 seconds, about 17 minutes. 
 
+// CN105 bridge: a TCP client on this port (e.g. 6638) gets the raw CN105 line, framed and one request at a time.
+// The firmware stops talking to the A/C while a client is connected. 0 disables the bridge.
+#define CN105_BRIDGE_PORT 0
+
 
 // Customization
 uint8_t min_temp                    = 16; // Minimum temperature, check value from heatpump remote control
@@ -139,6 +172,7 @@ uint32_t update_int                 = SEND_ROOM_TEMP_INTERVAL_MS;
 //Energy
 #define ENERGY_SAVE_THRESHOLD 0.1 //Save energy only if the value differentiate from previous value X kWh.
 #define ENERGY_SAVE_INTERVAL 10 //Save energy every 10 minutes
+#define CN105_SAVE_INTERVAL 60 //Save a changed CN105 timing profile at most every 60 minutes
 
 
 // temp settings
@@ -160,6 +194,10 @@ bool supportHeatMode = true;
   #define LED_OFF     LOW
   #define PIN_AC_TX 43
   #define PIN_AC_RX 44
+  // Extra CN105 ports for multi-head installs, unit 0 stays on Serial0. HP_EXTRA_UNITS is the number of
+  // HP_EXTRA_UNIT_PORTS entries in use ({UART, RX pin, TX pin} each), at most HeatPumpManager::MAX_UNITS - 1.
+  #define HP_EXTRA_UNITS 0
+  #define HP_EXTRA_UNIT_PORTS {{&Serial1, 17, 18}, {&Serial2, 15, 16}}
 #endif
 
 #ifdef ESP8266
@@ -20,6 +20,7 @@ const char html_menu_root[] PROGMEM = R"====(
         <button>_TXT_CONTROL_</button>
     </form>
 </div>
+_EXTRA_UNITS_
 <div>
     <form action='/setup' method='get'>
         <button>_TXT_SETUP_</button>
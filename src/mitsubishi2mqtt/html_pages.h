@@ -153,6 +153,28 @@ const char html_page_status[] PROGMEM =
     "</p>"
     "</fieldset>"
     "<br />"
+    "<fieldset>"
+    "<legend><b>&nbsp; _TXT_STATUS_BUS_ &nbsp;</b></legend>"
+    "<p><b>_TXT_STATUS_FRAMES_</b>"
+        " ==> "
+        "_BUS_FRAMES_"
+    "</p>"
+    "<p><b>_TXT_STATUS_ACKS_</b>"
+        " ==> "
+        "_BUS_ACKS_"
+    "</p>"
+    "<p><b>_TXT_STATUS_ERRORS_</b>"
+        " ==> "
+        "_BUS_ERRORS_"
+    "</p>"
+    "<p><b>_TXT_STATUS_LATENCY_</b>"
+        "_BUS_LATENCY_"
+    "</p>"
+    "<p>"
+        "<a class='button' href='/status?rbus'>_TXT_STATUS_RESET_STATS_</a>"
+    "</p>"
+    "</fieldset>"
+    "<br />"
     "<p>"
         "<a class='button back' href='/'>_TXT_BACK_</a>"
     "</p>"
@@ -206,6 +228,7 @@ const char html_page_control[] PROGMEM =
             "<br/>"
             "<button onclick='setTemp(0)' class='temp bgrn' style='text-align:center;width:30px;margin-left: 5px;margin-right: 2px;'>-</button>"
             "<form id='FTEMP_' style='display:inline'>"
+                "<input name='unit' type='hidden' value='_UNIT_INDEX_' />"
                 "<input name='TEMP' id='TEMP' type='text' value='_TEMP_' style='text-align:center;width:60px;margin-left: 5px;margin-right: 2px;' />"
             "</form>"
             "<button onclick='setTemp(1)' class='temp bgrn' style='text-align:center;width:30px;margin-left: 5px;margin-right: 2px;'>+</button>"
@@ -87,6 +87,12 @@ const char txt_status_mqtt[] PROGMEM = "Etat MQTT";
 const char txt_status_wifi[] PROGMEM = "WIFI RSSI";
 const char txt_status_connect[] PROGMEM = "CONNECTE";
 const char txt_status_disconnect[] PROGMEM = "DECONNECTE";
+const char txt_status_bus[] PROGMEM = "CN105 Bus";
+const char txt_status_frames[] PROGMEM = "Frames sent / received";
+const char txt_status_acks[] PROGMEM = "Commands acknowledged / sent";
+const char txt_status_errors[] PROGMEM = "Checksum / header / read errors / reply timeouts";
+const char txt_status_latency[] PROGMEM = "Replies / requests, latency p50 / p90";
+const char txt_status_reset_stats[] PROGMEM = "Reset statistics";
 
 //Page WIFI
 const char txt_wifi_title[] PROGMEM = "Paramétres WIFI";
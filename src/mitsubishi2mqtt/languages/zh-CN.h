@@ -88,6 +88,12 @@ const char txt_status_mqtt[] PROGMEM = "MQTT状态";
 const char txt_status_wifi[] PROGMEM = "WIFI信号";
 const char txt_status_connect[] PROGMEM = "已连接";
 const char txt_status_disconnect[] PROGMEM = "未连接";
+const char txt_status_bus[] PROGMEM = "CN105 Bus";
+const char txt_status_frames[] PROGMEM = "Frames sent / received";
+const char txt_status_acks[] PROGMEM = "Commands acknowledged / sent";
+const char txt_status_errors[] PROGMEM = "Checksum / header / read errors / reply timeouts";
+const char txt_status_latency[] PROGMEM = "Replies / requests, latency p50 / p90";
+const char txt_status_reset_stats[] PROGMEM = "Reset statistics";
 
 //Page WIFI
 const char txt_wifi_title[] PROGMEM = "WIFI参数";
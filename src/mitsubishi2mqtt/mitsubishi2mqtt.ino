@@ -33,12 +33,16 @@ ESP8266WebServer server(80); // ESP8266 web
 #endif
 
 #include "logger.h"
+#include "scheduler.h"
 #include <ArduinoJson.h>       // json to process MQTT: ArduinoJson 6.11.4
 #include <PubSubClient.h>      // MQTT: PubSubClient 2.8.0
 #include <DNSServer.h>         // DNS for captive portal
 #include <math.h>              // for rounding to Fahrenheit values
 #include <ArduinoOTA.h>        // for OTA
 #include <HeatPump.h>          // SwiCago library: https://github.com/SwiCago/HeatPump
+#include <HeatPumpManager.h>   // several CN105 ports on one board
+#include <HeatPumpWorker.h>    // the CN105 side in its own task, see HP_TASK_CORE
+#include <HeatPumpBridge.h>    // raw CN105 over TCP, see CN105_BRIDGE_PORT
 #include "config.h"            // config file
 #include "html_common.h"       // common code HTML (like header, footer)
 #include "javascript_common.h" // common code javascript (like refresh page)
@@ -105,13 +109,50 @@ boolean wifi_config = false;
 
 // HVAC
 HeatPump hp;
+HeatPumpManager hpManager; // hp is unit 0, the extra CN105 ports of HP_EXTRA_UNITS follow
+HeatPumpWorker hpWorker(&hpManager); // the only way to the units once setup() is done
+uint32_t hpUnitPublished[HeatPumpManager::MAX_UNITS] = {}; // getStateSequence() last published per extra unit
+unsigned long lastUnitsHeartbeat = 0;
+#if defined(ESP32) && HP_EXTRA_UNITS > 0
+struct HpPort
+{
+  HardwareSerial *serial;
+  int rx;
+  int tx;
+};
+const HpPort hpExtraPorts[] = HP_EXTRA_UNIT_PORTS;
+#endif
+#if CN105_BRIDGE_PORT > 0
+WiFiServer bridgeServer(CN105_BRIDGE_PORT);
+WiFiClient bridgeClient;
+HeatPumpStreamTransport bridgeClientTransport(&bridgeClient);
+HeatPumpSerialTransport bridgeUnitTransport(acSerial);
+HeatPumpBridge hpBridge(&bridgeUnitTransport, &bridgeClientTransport);
+bool bridgeActive = false; // hp is disconnected while a bridge client owns the CN105 line
+bool bridgePending = false; // a client is waiting for hp to let go of the line
+uint32_t bridgeDisconnect = 0; // hpWorker command sequence of that disconnect
+#endif
 unsigned long lastUpdate ;
 unsigned long lastCommandSend;
-unsigned long lastMqttRetry;
-unsigned long lastHpSync;
+Scheduler scheduler; // runs the task* functions from loop(), see setupTasks()
+int hpReconnectTask = -1;
+int hpFunctionsTask = -1;
+bool hpBridged = false; // a CN105 bridge client owns the line, see hpBridgeLoop()
 unsigned int hpConnectionRetries;
 unsigned int hpConnectionTotalRetries;
+byte hpLinkState = HeatPump::LINK_OK; // last state logged by hpLogLink()
+bool hpConnected = false;  // hpWorker.getState(0) as last seen by taskHeatPump()
+bool hpConnecting = false;
+int hpBitrate = 0; // CN105 bitrate saved in cn105_file
+uint16_t hpCapabilities = 0; // HeatPump::CAP_* profile saved in cn105_file
+HeatPump::TimingProfile hpTiming {}; // learned CN105 timing saved in cn105_file
+uint32_t publishedStateSequence = 0; // stateSequence of the last state published to ha_state_topic
+float publishedEnergy = -1;
+unsigned long lastStatePublish = 0;
+bool statePublishPending = true; // publish even if the A/C reported no change, e.g. after a local state
+uint32_t publishedFunctionsSequence = 0; // stateSequence of the last functions published to ha_functions_topic
 float energy = 0; // kWh
+float lastEnergySavedValue = 0;
 bool previousCMDisPower = true;
 
 // Local state
@@ -141,11 +182,11 @@ bool connectWifi();
 bool checkLogin();
 float convertCelsiusToLocalUnit(float temperature, bool isFahrenheit);
 float convertLocalUnitToCelsius(float temperature, bool isFahrenheit);
-heatpumpSettings change_states(heatpumpSettings settings);
+heatpumpSettings change_states(int unit, heatpumpSettings settings);
 String getTemperatureScale();
 bool is_authenticated();
 String hpGetMode(heatpumpSettings hvacSettings);
-void hpStatusChanged(heatpumpStatus currentStatus);
+void hpStatusChanged(const heatpumpStatus &currentStatus);
 void readHPstate();
 void playBeep(Buzzer_preset buzzer_preset);
 void updateUnitSettings();
@@ -164,6 +205,28 @@ void checkMRD()
 }
 #endif
 
+#ifdef ESP8266
+// Factory test: send what the setters changed and wait until the A/C has acknowledged it. update() is refused
+// right after a reply and while the previous packet is unacknowledged, sync() takes the ack (or retransmits).
+void testModeUpdate()
+{
+  unsigned long start = millis();
+  while (millis() - start < 20000) // longer than the pause HeatPump keeps after a power change
+  {
+    if (hp.sendPending())
+    {
+      hp.update();
+    }
+    else if (!hp.isUpdating())
+    {
+      return;
+    }
+    hp.sync();
+    delay(10);
+  }
+}
+#endif
+
 void testMode()
 {
 
@@ -176,7 +239,13 @@ void testMode()
     digitalWrite(LED_ACT, LOW);
     delay(100);
   }
-  if (!hp.connect(acSerial))
+  hp.connect(acSerial);
+  while (hp.isConnecting())
+  {
+    hp.sync();
+    delay(10);
+  }
+  if (!hp.isConnected())
   {
     while (1)
     {
@@ -189,10 +258,10 @@ void testMode()
   digitalWrite(LED_ACT, HIGH);
   hp.setModeSetting("FAN");
   hp.setPowerSetting("ON");
-  hp.update();
+  testModeUpdate();
   delay(1000);
   hp.setPowerSetting("OFF");
-  hp.update();
+  testModeUpdate();
 
   SPIFFS.format();
 
@@ -572,6 +641,32 @@ void saveEnergy(float cur_energy)
   energyFile.close();
 }
 
+void saveCN105()
+{
+  if (hpWorker.getDetails().takenAt != 0)
+  {
+    hpTiming = hpWorker.getDetails().timing;
+  }
+  const size_t capacity = JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(5);
+  DynamicJsonDocument doc(capacity);
+  doc["bitrate"] = hpBitrate;
+  doc["capabilities"] = hpCapabilities;
+  JsonObject timing = doc.createNestedObject("timing");
+  timing["reply"] = hpTiming.replyMs;
+  timing["reply_dev"] = hpTiming.replyDevMs;
+  timing["power_settle"] = hpTiming.powerSettleMs;
+  timing["settle"] = hpTiming.settleMs;
+  timing["samples"] = hpTiming.samples;
+  File cn105File = SPIFFS.open(cn105_file, "w");
+  if (!cn105File)
+  {
+    Serial.println(F("Failed to save CN105 file for writing"));
+  }
+  serializeJson(doc, cn105File);
+  delay(10);
+  cn105File.close();
+}
+
 void saveOthers(String haa, String haat, String availability_report, String debug)
 {
   const size_t capacity = JSON_OBJECT_SIZE(4) + 130;
@@ -775,6 +870,48 @@ bool loadEnergy()
   return true;
 }
 
+bool loadCN105()
+{
+  if (!SPIFFS.exists(cn105_file))
+  {
+    return false;
+  }
+  File cn105File = SPIFFS.open(cn105_file, "r");
+  if (!cn105File)
+  {
+    return false;
+  }
+
+  size_t size = cn105File.size();
+  if (size > 1024)
+  {
+    return false;
+  }
+  std::unique_ptr<char[]> buf(new char[size]);
+
+  cn105File.readBytes(buf.get(), size);
+  const size_t capacity = JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(5);
+  DynamicJsonDocument doc(capacity);
+  deserializeJson(doc, buf.get());
+  // bitrate of the last successful connect, tried first on the next one
+  hpBitrate = doc["bitrate"].as<int>();
+  hp.setPreferredBitrate(hpBitrate);
+  // what the unit answers, skips the capability probe after connect
+  hpCapabilities = doc["capabilities"].as<uint16_t>();
+  hp.setCapabilities(hpCapabilities);
+  // learned reply latency and settle times, the library starts from its conservative defaults without them
+  if (doc.containsKey("timing"))
+  {
+    hpTiming.replyMs = doc["timing"]["reply"].as<uint16_t>();
+    hpTiming.replyDevMs = doc["timing"]["reply_dev"].as<uint16_t>();
+    hpTiming.powerSettleMs = doc["timing"]["power_settle"].as<uint16_t>();
+    hpTiming.settleMs = doc["timing"]["settle"].as<uint16_t>();
+    hpTiming.samples = doc["timing"]["samples"].as<uint16_t>();
+    hp.setTimingProfile(hpTiming);
+  }
+  return true;
+}
+
 bool loadOthers()
 {
   if (!SPIFFS.exists(others_conf))
@@ -972,7 +1109,17 @@ void handleRoot()
     String menuRootPage = FPSTR(html_menu_root);
     menuRootPage.replace("_SHOW_LOGOUT_", (String)(login_password.length() > 0));
     // not show control button if hp not connected
-    menuRootPage.replace("_SHOW_CONTROL_", (String)(hp.isConnected()));
+    menuRootPage.replace("_SHOW_CONTROL_", (String)(hpWorker.getState(0).connected));
+    String extraUnits;
+    for (int i = 1; i < hpWorker.getUnitCount(); i++)
+    {
+      if (hpWorker.getState(i).connected)
+      {
+        extraUnits += "<div><form action='/control' method='get'><input type='hidden' name='unit' value='" + String(i) +
+                      "'/><button>_TXT_CONTROL_ #" + String(i) + "</button></form></div>";
+      }
+    }
+    menuRootPage.replace("_EXTRA_UNITS_", extraUnits);
     menuRootPage.replace("_TXT_CONTROL_", FPSTR(txt_control));
     menuRootPage.replace("_TXT_SETUP_", FPSTR(txt_setup));
     menuRootPage.replace("_TXT_STATUS_", FPSTR(txt_status));
@@ -1284,6 +1431,8 @@ void handleStatus()
 
   if (server.hasArg("mrconn"))
     mqttConnect();
+  if (server.hasArg("rbus"))
+    hpWorker.resetBusStats(0);
 
   String connected = F("<span style='color:#47c266'><b>");
   connected += FPSTR(txt_status_connect);
@@ -1293,7 +1442,7 @@ void handleStatus()
   disconnected += FPSTR(txt_status_disconnect);
   disconnected += F("</b></span>");
 
-  if (hp.isConnected())
+  if (hpWorker.getState(0).connected)
     statusPage.replace(F("_HVAC_STATUS_"), connected);
   else
     statusPage.replace(F("_HVAC_STATUS_"), disconnected);
@@ -1304,6 +1453,35 @@ void handleStatus()
   statusPage.replace(F("_HVAC_RETRIES_"), String(hpConnectionTotalRetries));
   statusPage.replace(F("_MQTT_REASON_"), String(mqtt_client.state()));
   statusPage.replace(F("_WIFI_STATUS_"), String(WiFi.RSSI()));
+
+  const HeatPump::BusStats &stats = hpWorker.getDetails().busStats;
+  statusPage.replace("_TXT_STATUS_BUS_", FPSTR(txt_status_bus));
+  statusPage.replace("_TXT_STATUS_FRAMES_", FPSTR(txt_status_frames));
+  statusPage.replace("_TXT_STATUS_ACKS_", FPSTR(txt_status_acks));
+  statusPage.replace("_TXT_STATUS_ERRORS_", FPSTR(txt_status_errors));
+  statusPage.replace("_TXT_STATUS_LATENCY_", FPSTR(txt_status_latency));
+  statusPage.replace("_TXT_STATUS_RESET_STATS_", FPSTR(txt_status_reset_stats));
+  statusPage.replace(F("_BUS_FRAMES_"), String(stats.framesSent) + " / " + String(stats.framesReceived));
+  statusPage.replace(F("_BUS_ACKS_"), String(stats.controlAcked) + " / " + String(stats.controlSent));
+  statusPage.replace(F("_BUS_ERRORS_"), String(stats.checksumErrors) + " / " + String(stats.headerRejects) + " / " +
+                                            String(stats.readTimeouts) + " / " + String(stats.replyTimeouts));
+  String latency;
+  for (int i = 0; i < HeatPump::STATS_COMMANDS_LEN && stats.commands[i].type != 0; i++)
+  {
+    const HeatPump::CommandStats &command = stats.commands[i];
+    uint16_t p50 = latencyPercentile(command, 50);
+    uint16_t p90 = latencyPercentile(command, 90);
+    latency += "<br/>" + requestName(command) + ": " + String(command.replied) + " / " + String(command.sent);
+    if (command.replied > 0)
+    {
+      latency += F(" &le;");
+      latency += p50 ? String(p50) : String(F("&infin;"));
+      latency += F(" / &le;");
+      latency += p90 ? String(p90) : String(F("&infin;"));
+      latency += F(" ms");
+    }
+  }
+  statusPage.replace(F("_BUS_LATENCY_"), latency);
   sendWrappedHTML(statusPage);
 }
 
@@ -1313,15 +1491,16 @@ void handleControl()
     return;
 
   // not connected to hp, redirect to status page
-  if (!hp.isConnected())
+  int unitIndex = server.hasArg("unit") ? server.arg("unit").toInt() : 0;
+  if (unitIndex < 0 || unitIndex >= hpWorker.getUnitCount() || !hpWorker.getState(unitIndex).connected)
   {
     server.sendHeader("Location", "/status");
     server.sendHeader("Cache-Control", "no-cache");
     server.send(302);
     return;
   }
-  heatpumpSettings settings = hp.getSettings();
-  settings = change_states(settings);
+  const HeatPumpWorker::State &state = hpWorker.getState(unitIndex);
+  heatpumpSettings settings = change_states(unitIndex, state.settings);
   String controlPage = FPSTR(html_page_control);
   String headerContent = FPSTR(html_common_header);
   String footerContent = FPSTR(html_common_footer);
@@ -1329,9 +1508,10 @@ void handleControl()
   headerContent.replace("_UNIT_NAME_", hostname);
   footerContent.replace("_VERSION_", m2mqtt_version);
   controlPage.replace("_TXT_BACK_", FPSTR(txt_back));
-  controlPage.replace("_UNIT_NAME_", hostname);
+  controlPage.replace("_UNIT_NAME_", unitIndex == 0 ? hostname : hostname + " #" + String(unitIndex));
+  controlPage.replace("_UNIT_INDEX_", String(unitIndex));
   controlPage.replace("_RATE_", "60");
-  controlPage.replace("_ROOMTEMP_", String(convertCelsiusToLocalUnit(hp.getRoomTemperature(), useFahrenheit)));
+  controlPage.replace("_ROOMTEMP_", String(convertCelsiusToLocalUnit(state.status.roomTemperature, useFahrenheit)));
   controlPage.replace("_USE_FAHRENHEIT_", (String)useFahrenheit);
   controlPage.replace("_TEMP_SCALE_", getTemperatureScale());
   controlPage.replace("_HEAT_MODE_SUPPORT_", (String)supportHeatMode);
@@ -1472,7 +1652,7 @@ void handleControl()
   {
     controlPage.replace("_WVANE_S_", "selected");
   }
-  controlPage.replace("_TEMP_", String(convertCelsiusToLocalUnit(hp.getTemperature(), useFahrenheit)));
+  controlPage.replace("_TEMP_", String(convertCelsiusToLocalUnit(state.settings.temperature, useFahrenheit)));
 
   // We need to send the page content in chunks to overcome
   // a limitation on the maximum size we can send at one
@@ -1671,7 +1851,6 @@ void handleUploadLoop()
     if (mqtt_client.state() == MQTT_CONNECTED)
     {
       mqtt_client.disconnect();
-      lastMqttRetry = millis();
     }
 
     // Serial.printl(log);
@@ -1774,6 +1953,29 @@ void handleAPILogs()
   }
 }
 
+// Cached installer functions, ?refresh reads them again, ?code=118&value=2 changes one
+void handleAPIFunctions()
+{
+  if (!checkLogin())
+    return;
+
+  if (server.hasArg("refresh"))
+  {
+    hpWorker.requestFunctions(0);
+  }
+  if (server.hasArg("code") && server.hasArg("value"))
+  {
+    heatpumpFunctions functions = hpWorker.getState(0).functions;
+    if (!functions.isValid() || !functions.setValue(server.arg("code").toInt(), server.arg("value").toInt()) ||
+        !hpWorker.setFunctions(0, functions))
+    {
+      server.send(400, F("application/json"), F("{\"error\":\"invalid function\"}"));
+      return;
+    }
+  }
+  server.send(200, F("application/json"), hpFunctionsJson());
+}
+
 void write_log(String log)
 {
   File logFile = SPIFFS.open(console_file, "a");
@@ -1781,57 +1983,77 @@ void write_log(String log)
   logFile.close();
 }
 
-heatpumpSettings change_states(heatpumpSettings settings)
+heatpumpSettings change_states(int unit, heatpumpSettings settings)
 {
   if (server.hasArg("CONNECT"))
   {
-    hp.connect(acSerial);
+    if (unit == 0)
+    {
+      hpWorker.connect(0); // the extra units reconnect by themselves, see HeatPumpManager
+    }
   }
   else
   {
     bool update = false;
-    if (server.hasArg("POWER"))
-    {
-      settings.power = strdup(server.arg("POWER").c_str());
+    // web args are parsed into the typed settings here, settings only gets the library's own strings back
+    HeatPump::Power power;
+    HeatPump::Mode mode;
+    HeatPump::Fan fan;
+    HeatPump::Vane vane;
+    HeatPump::WideVane wideVane;
+    if (server.hasArg("POWER") && HeatPump::fromString(server.arg("POWER").c_str(), power))
+    {
+      hpWorker.setPowerSetting(unit, power);
+      settings.power = HeatPump::toString(power);
       Log.ln(TAG, "Power = " + String(settings.power));
       update = true;
-      previousCMDisPower = true;
+      if (unit == 0)
+      {
+        previousCMDisPower = true;
+      }
     }
-    if (server.hasArg("MODE"))
+    if (server.hasArg("MODE") && HeatPump::fromString(server.arg("MODE").c_str(), mode))
     {
-      settings.mode = strdup(server.arg("MODE").c_str());
+      hpWorker.setModeSetting(unit, mode);
+      settings.mode = HeatPump::toString(mode);
       Log.ln(TAG, "Mode = " + String(settings.mode));
       update = true;
     }
     if (server.hasArg("TEMP"))
     {
       settings.temperature = convertLocalUnitToCelsius(server.arg("TEMP").toInt(), useFahrenheit);
+      hpWorker.setTemperature(unit, settings.temperature);
       Log.ln(TAG, "Temp = " + String(settings.temperature));
       update = true;
     }
-    if (server.hasArg("FAN"))
+    if (server.hasArg("FAN") && HeatPump::fromString(server.arg("FAN").c_str(), fan))
     {
-      settings.fan = strdup(server.arg("FAN").c_str());
+      hpWorker.setFanSpeed(unit, fan);
+      settings.fan = HeatPump::toString(fan);
       Log.ln(TAG, "Fan = " + String(settings.fan));
       update = true;
     }
-    if (server.hasArg("VANE"))
+    if (server.hasArg("VANE") && HeatPump::fromString(server.arg("VANE").c_str(), vane))
     {
-      settings.vane = strdup(server.arg("VANE").c_str());
+      hpWorker.setVaneSetting(unit, vane);
+      settings.vane = HeatPump::toString(vane);
       Log.ln(TAG, "Vane = " + String(settings.vane));
       update = true;
     }
-    if (server.hasArg("WIDEVANE"))
+    if (server.hasArg("WIDEVANE") && HeatPump::fromString(server.arg("WIDEVANE").c_str(), wideVane))
     {
-      settings.wideVane = strdup(server.arg("WIDEVANE").c_str());
+      hpWorker.setWideVaneSetting(unit, wideVane);
+      settings.wideVane = HeatPump::toString(wideVane);
       Log.ln(TAG, "WideVane = " + String(settings.wideVane));
       update = true;
     }
     if (update)
     {
       playBeep(SET);
-      hp.setSettings(settings);
-      lastCommandSend = millis();
+      if (unit == 0)
+      {
+        lastCommandSend = millis();
+      }
     }
   }
   return settings;
@@ -1839,7 +2061,7 @@ heatpumpSettings change_states(heatpumpSettings settings)
 
 void readHeatPumpSettings()
 {
-  heatpumpSettings currentSettings = hp.getSettings();
+  heatpumpSettings currentSettings = hpWorker.getState(0).settings;
 
   rootInfo.clear();
   rootInfo["temperature"] = convertCelsiusToLocalUnit(currentSettings.temperature, useFahrenheit);
@@ -1849,6 +2071,23 @@ void readHeatPumpSettings()
   rootInfo["mode"] = hpGetMode(currentSettings);
 }
 
+void hpUpdateResult(int unit, unsigned int sequence, int result)
+{
+  if (unit != 0)
+  {
+    return; // the extra units are published from what changed, see hpPublishExtraUnits()
+  }
+  Log.ln(TAG, "Command #" + String(sequence) + (result == HeatPump::CMD_RESULT_OK ? " confirmed" : " failed"));
+  // the A/C answered (or never will), publish its state now instead of waiting out POLL_DELAY_AFTER_SET_MS
+  lastCommandSend = 0;
+  lastUpdate = 0;
+  statePublishPending = true;
+  if (result != HeatPump::CMD_RESULT_OK)
+  {
+    hpSettingsChanged(); // let HA revert to what the A/C reports
+  }
+}
+
 void hpSettingsChanged()
 {
   // Log.ln(TAG, "hpSettingsChanged");
@@ -1867,7 +2106,7 @@ void hpSettingsChanged()
     //   if (_debugMode) mqtt_client.publish(ha_debug_topic.c_str(), (char*)("Failed to publish hp settings"));
     // }
 
-    hpStatusChanged(hp.getStatus());
+    hpStatusChanged(hpWorker.getState(0).status);
     
   }
   
@@ -1925,29 +2164,19 @@ String hpGetAction(heatpumpStatus hpStatus, heatpumpSettings hpSettings)
     return hpmode; // unknown
 }
 
-void calculateEnergy(heatpumpStatus currentStatus)
+void calculateEnergy(const heatpumpStatus &currentStatus)
 {
   static unsigned long lastUpdate = millis();
-  static float lastEnergySavedValue = 0;
-  static unsigned long lastEnergySavedTime = 0;
 
   int currentPower = currentStatus.power;
   int secondSyncUpdate = (millis() - lastUpdate) / 1000;
   float sectionEnergy = currentPower * (secondSyncUpdate / 3600.0); // Wh
   energy += sectionEnergy / 1000;                                   // kWh
 
-  if (energy - lastEnergySavedValue > ENERGY_SAVE_THRESHOLD && millis() - lastEnergySavedTime > (ENERGY_SAVE_INTERVAL * 60000))
-  {
-    Log.ln(TAG, "Save energy to SPIFFS");
-    saveEnergy(energy);
-    lastEnergySavedTime = millis();
-    lastEnergySavedValue = energy;
-  }
-
   lastUpdate = millis();
 }
 
-void hpStatusChanged(heatpumpStatus currentStatus)
+void hpStatusChanged(const heatpumpStatus &currentStatus)
 {
 
 
@@ -1955,13 +2184,27 @@ void hpStatusChanged(heatpumpStatus currentStatus)
   if ((millis() - lastUpdate > update_int) && (millis()  - lastCommandSend >  ((previousCMDisPower) ? 30000 : POLL_DELAY_AFTER_SET_MS ))) { // only send the temperature every update_int interval and not just sent command to A/C.
 
     // send room temp, operating info and all information
-    heatpumpSettings currentSettings = hp.getSettings();
+    const HeatPumpWorker::State &state = hpWorker.getState(0);
+    heatpumpSettings currentSettings = state.settings;
 
     calculateEnergy(currentStatus);
 
     if (currentStatus.roomTemperature == 0)
       return;
 
+    // only publish when the A/C reported something new, the energy moved or the heartbeat is due
+    float roundedEnergy = roundf(energy * 100) / 100;
+    if (!statePublishPending && hpWorker.getChangedSince(0, publishedStateSequence) == 0 && roundedEnergy == publishedEnergy &&
+        millis() - lastStatePublish < STATE_HEARTBEAT_INTERVAL_MS)
+    {
+      lastUpdate = millis();
+      return;
+    }
+    publishedStateSequence = state.stateSequence;
+    publishedEnergy = roundedEnergy;
+    lastStatePublish = millis();
+    statePublishPending = false;
+
     rootInfo.clear();
     rootInfo["roomTemperature"] = convertCelsiusToLocalUnit(currentStatus.roomTemperature, useFahrenheit);
     rootInfo["temperature"] = convertCelsiusToLocalUnit(currentSettings.temperature, useFahrenheit);
@@ -1972,7 +2215,7 @@ void hpStatusChanged(heatpumpStatus currentStatus)
     rootInfo["action"] = hpGetAction(currentStatus, currentSettings);
     rootInfo["compressorFrequency"] = currentStatus.compressorFrequency;
     rootInfo["power"] = currentStatus.power;
-    rootInfo["energy"] = roundf(energy * 100) / 100;
+    rootInfo["energy"] = roundedEnergy;
     String mqttOutput;
     serializeJson(rootInfo, mqttOutput);
 
@@ -1982,7 +2225,7 @@ void hpStatusChanged(heatpumpStatus currentStatus)
         mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Failed to publish hp status change"));
     }
 
-    readHPstate(currentSettings, hp.getStatus());
+    readHPstate(currentSettings, state.status);
 
     #ifdef ESP32
     Log.ln(TAG, "PSRAM size:\t" + String(ESP.getPsramSize()));
@@ -2011,31 +2254,368 @@ void updateUnitSettings(){
     }
 }
 
-void hpPacketDebug(byte *packet, unsigned int length, const char *packetDirection)
+// CN105 frames recorded by hp while debug mode is on, formatted only here; builds without the trace
+// (HEATPUMP_TRACE_FRAMES 0, see platformio.ini) keep the other debug messages only
+void hpPublishTrace()
 {
-  if (_debugMode)
+#if HEATPUMP_TRACE_FRAMES > 0
+  HeatPump::TraceEntry entry;
+  char hex[HeatPump::TRACE_FRAME_LEN * 3];
+  char mqttOutput[sizeof(hex) + 48];
+  int unit;
+  while (hpWorker.popTrace(unit, entry))
   {
-    String message;
-    for (unsigned int idx = 0; idx < length; idx++)
+    if (unit != 0)
     {
-      if (packet[idx] < 16)
+      continue; // the debug topic is unit 0's, the extra units have no debug mode
+    }
+    HeatPump::formatTrace(entry, hex, sizeof(hex));
+    StaticJsonDocument<JSON_OBJECT_SIZE(2)> root;
+    root[entry.direction == HeatPump::TRACE_SENT ? "packetSent" : "packetRecv"] = (const char *)hex;
+    root["ms"] = entry.time;
+    serializeJson(root, mqttOutput, sizeof(mqttOutput));
+    if (!mqtt_client.publish(ha_debug_topic.c_str(), mqttOutput))
+    {
+      mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Failed to publish to heatpump/debug topic"));
+      break;
+    }
+  }
+#endif
+}
+
+// Upper bound in ms of the latency bucket holding the given percentage of the replies, 0 if it is the open last bucket
+uint16_t latencyPercentile(const HeatPump::CommandStats &command, int percent)
+{
+  uint32_t target = (command.replied * percent + 99) / 100;
+  uint32_t count = 0;
+  for (int i = 0; i < HeatPump::LATENCY_BUCKETS; i++)
+  {
+    count += command.latency[i];
+    if (count >= target)
+    {
+      return HeatPump::LATENCY_BUCKET_MS[i];
+    }
+  }
+  return 0;
+}
+
+String requestName(const HeatPump::CommandStats &command)
+{
+  char name[6];
+  snprintf(name, sizeof(name), "%02X/%02X", command.type, command.command);
+  return String(name);
+}
+
+void hpPublishDiagnostics()
+{
+  const HeatPumpWorker::Details &details = hpWorker.getDetails();
+  const HeatPump::BusStats &stats = details.busStats;
+  const size_t bufferSize = JSON_OBJECT_SIZE(17) + JSON_ARRAY_SIZE(HeatPump::STATS_COMMANDS_LEN) +
+                            HeatPump::STATS_COMMANDS_LEN * (JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(HeatPump::LATENCY_BUCKETS)) +
+                            JSON_OBJECT_SIZE(HeatPump::REGISTER_COUNT) + HeatPump::REGISTER_COUNT * (HeatPump::REGISTER_LEN * 3 + 3) + 256;
+  DynamicJsonDocument root(bufferSize);
+
+  root["period"] = (millis() - stats.since) / 1000;
+  root["frames_sent"] = stats.framesSent;
+  root["frames_received"] = stats.framesReceived;
+  root["checksum_errors"] = stats.checksumErrors;
+  root["header_rejects"] = stats.headerRejects;
+  root["read_timeouts"] = stats.readTimeouts;
+  root["reply_timeouts"] = stats.replyTimeouts;
+  root["control_sent"] = stats.controlSent;
+  root["control_acked"] = stats.controlAcked;
+  root["link_probes"] = stats.linkProbes;
+  root["link_resets"] = stats.linkResets;
+  root["link_reconnects"] = stats.linkReconnects;
+  root["reply_wait"] = details.responseWaitMs;
+  JsonArray requests = root.createNestedArray("requests");
+  for (int i = 0; i < HeatPump::STATS_COMMANDS_LEN && stats.commands[i].type != 0; i++)
+  {
+    const HeatPump::CommandStats &command = stats.commands[i];
+    JsonObject request = requests.createNestedObject();
+    request["request"] = requestName(command);
+    request["sent"] = command.sent;
+    request["replied"] = command.replied;
+    request["p50"] = latencyPercentile(command, 50);
+    JsonArray latency = request.createNestedArray("latency");
+    for (int j = 0; j < HeatPump::LATENCY_BUCKETS; j++)
+    {
+      latency.add(command.latency[j]);
+    }
+  }
+  // raw payload of the last reply to each info request, e.g. "02": "00 00 00 01 03 ..."
+  JsonObject registers = root.createNestedObject("registers");
+  for (int i = 0; i < HeatPump::REGISTER_COUNT; i++)
+  {
+    if (!(details.registersValid & (1 << i)))
+    {
+      continue;
+    }
+    const byte *reg = details.registers[i];
+    char name[3];
+    char hex[HeatPump::REGISTER_LEN * 3];
+    int length = 0;
+    snprintf(name, sizeof(name), "%02x", HeatPump::REGISTER_COMMANDS[i]);
+    for (int j = 0; j < HeatPump::REGISTER_LEN; j++)
+    {
+      length += snprintf(hex + length, sizeof(hex) - length, j == 0 ? "%02x" : " %02x", reg[j]);
+    }
+    registers[name] = hex; // both copied into the document
+  }
+
+  String mqttOutput;
+  serializeJson(root, mqttOutput);
+  mqtt_client.beginPublish(ha_diagnostics_topic.c_str(), mqttOutput.length(), false);
+  mqtt_client.print(mqttOutput);
+  mqtt_client.endPublish();
+}
+
+// as HeatPump::isFunctionsStale(FUNCTIONS_REFRESH_INTERVAL_MS)
+bool hpFunctionsStale()
+{
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  return state.functionsStale || millis() - state.functionsReadAt > FUNCTIONS_REFRESH_INTERVAL_MS;
+}
+
+// Cached installer functions as {"age": s, "stale": bool, "codes": {"101": 1, ...}}, age -1 if never read
+String hpFunctionsJson()
+{
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  heatpumpFunctions functions = state.functions;
+  heatpumpFunctionCodes codes = functions.getAllCodes();
+  const size_t bufferSize = JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(MAX_FUNCTION_CODE_COUNT) + MAX_FUNCTION_CODE_COUNT * 4;
+  DynamicJsonDocument root(bufferSize);
+
+  root["age"] = state.functionsReadAt == 0 ? -1 : (long)((millis() - state.functionsReadAt) / 1000);
+  root["stale"] = hpFunctionsStale();
+  JsonObject values = root.createNestedObject("codes");
+  for (int i = 0; functions.isValid() && i < MAX_FUNCTION_CODE_COUNT; i++)
+  {
+    if (codes.valid[i])
+    {
+      values[String(codes.code[i])] = functions.getValue(codes.code[i]);
+    }
+  }
+
+  String output;
+  serializeJson(root, output);
+  return output;
+}
+
+void hpPublishFunctions()
+{
+  String mqttOutput = hpFunctionsJson();
+  mqtt_client.beginPublish(ha_functions_topic.c_str(), mqttOutput.length(), true);
+  mqtt_client.print(mqttOutput);
+  mqtt_client.endPublish();
+}
+
+// Log the steps hp takes when the A/C goes quiet, see HeatPump::getLinkState()
+void hpLogLink()
+{
+  const HeatPumpWorker::State &unit = hpWorker.getState(0);
+  byte state = unit.connected ? unit.linkState : HeatPump::LINK_OK;
+  if (state == hpLinkState)
+  {
+    return;
+  }
+  if (state == HeatPump::LINK_PROBING)
+  {
+    Log.ln(TAG, "HVAC quiet, probing");
+  }
+  else if (state == HeatPump::LINK_RESET)
+  {
+    Log.ln(TAG, "HVAC still quiet, UART reopened");
+  }
+  else if (unit.connected)
+  {
+    Log.ln(TAG, "HVAC answering again");
+  }
+  else
+  {
+    Log.ln(TAG, "HVAC quiet for a minute, reconnecting");
+  }
+  hpLinkState = state;
+}
+
+// CN105 bridge, see CN105_BRIDGE_PORT. A client takes the line over from hp until it disconnects; returns true
+// while it does, the loop then leaves the A/C alone. The bridge starts once hpWorker reports hp detached.
+bool hpBridgeLoop()
+{
+#if CN105_BRIDGE_PORT > 0
+  if (!bridgeActive)
+  {
+    if (!bridgePending)
+    {
+      WiFiClient client = bridgeServer.available();
+      if (!client)
       {
-        message += "0"; // pad single hex digits with a 0
+        return false;
       }
-      message += String(packet[idx], HEX) + " ";
+      bridgeClient = client;
+      bridgeClient.setNoDelay(true);
+      bridgePending = hpWorker.disconnect(0);
+      bridgeDisconnect = hpWorker.getCommandSequence(0);
+      return bridgePending;
+    }
+    // detached may still be set from the previous client, only a snapshot taken after the disconnect counts
+    const HeatPumpWorker::State &state = hpWorker.getState(0);
+    if (!state.detached || (int32_t)(state.commandSequence - bridgeDisconnect) < 0)
+    {
+      return true; // hp is still letting go of the line
+    }
+    bridgePending = false;
+    hpBridge.resetStats();
+    hpBridge.begin(state.preferredBitrate > 0 ? state.preferredBitrate : 2400);
+    bridgeActive = true;
+    Log.ln(TAG, "CN105 bridge: " + bridgeClient.remoteIP().toString() + " connected");
+  }
+  if (bridgeClient.connected())
+  {
+    hpBridge.loop();
+    return true;
+  }
+  HeatPumpBridge::Stats stats = hpBridge.getStats();
+  Log.ln(TAG, "CN105 bridge: client gone, " + String(stats.framesToUnit) + " frames sent, " +
+              String(stats.framesFromUnit) + " received, " + String(stats.rejectedBytes) + " bytes rejected, " +
+              String(stats.replyTimeouts) + " timeouts");
+  bridgeClient.stop();
+  bridgeActive = false;
+  hpWorker.connect(0);
+#endif
+  return false;
+}
+
+// Extra CN105 units, see HP_EXTRA_UNITS. They have no callbacks, the loop publishes what getChangedSince() reports.
+void hpSetupExtraUnits()
+{
+#if defined(ESP32) && HP_EXTRA_UNITS > 0
+  for (int i = 0; i < HP_EXTRA_UNITS && i < (int)(sizeof(hpExtraPorts) / sizeof(hpExtraPorts[0])); i++)
+  {
+    HeatPump *unit = hpManager.getUnit(hpManager.addUnit());
+    if (unit == nullptr)
+    {
+      break;
     }
+    unit->setEventMask(0);
+    unit->disableAutoUpdate();
+    unit->connect(hpExtraPorts[i].serial, 0, hpExtraPorts[i].rx, hpExtraPorts[i].tx);
+    Log.ln(TAG, "HVAC unit " + String(i + 1) + " connecting...");
+  }
+#endif
+}
+
+// topic/unitN/<leaf>, built when needed instead of keeping a set of Strings per unit
+String hpUnitTopic(int index, const char *leaf)
+{
+  return mqtt_topic + "/" + mqtt_fn + "/unit" + String(index) + "/" + leaf;
+}
 
-    const size_t bufferSize = JSON_OBJECT_SIZE(10);
-    StaticJsonDocument<bufferSize> root;
+void hpPublishExtraUnits()
+{
+  if (millis() - lastUnitsHeartbeat > STATE_HEARTBEAT_INTERVAL_MS)
+  {
+    memset(hpUnitPublished, 0, sizeof(hpUnitPublished));
+    lastUnitsHeartbeat = millis();
+  }
+
+  for (int i = 1; i < hpWorker.getUnitCount(); i++)
+  {
+    const HeatPumpWorker::State &unit = hpWorker.getState(i);
+    if (!unit.connected || hpWorker.getChangedSince(i, hpUnitPublished[i]) == 0)
+    {
+      continue;
+    }
+    hpUnitPublished[i] = unit.stateSequence;
 
-    root[packetDirection] = message;
+    const heatpumpSettings &settings = unit.settings;
+    const heatpumpStatus &status = unit.status;
+    StaticJsonDocument<256> doc;
+    doc["roomTemperature"] = convertCelsiusToLocalUnit(status.roomTemperature, useFahrenheit);
+    doc["temperature"] = convertCelsiusToLocalUnit(settings.temperature, useFahrenheit);
+    doc["fan"] = settings.fan;
+    doc["vane"] = settings.vane;
+    doc["wideVane"] = settings.wideVane;
+    doc["mode"] = hpGetMode(settings);
+    doc["action"] = hpGetAction(status, settings);
+    doc["compressorFrequency"] = status.compressorFrequency;
+    doc["power"] = status.power;
     String mqttOutput;
-    serializeJson(root, mqttOutput);
-    if (!mqtt_client.publish(ha_debug_topic.c_str(), mqttOutput.c_str()))
+    serializeJson(doc, mqttOutput);
+    mqtt_client.publish(hpUnitTopic(i, "state").c_str(), mqttOutput.c_str(), false);
+  }
+}
+
+// topic/unitN/<power|mode|temp|fan|vane|wideVane>/set, same payloads as the topics of unit 0
+bool hpExtraUnitCallback(const char *topic, const char *message)
+{
+  String prefix = mqtt_topic + "/" + mqtt_fn + "/unit";
+  if (strncmp(topic, prefix.c_str(), prefix.length()) != 0)
+  {
+    return false;
+  }
+  char *field;
+  int index = strtol(topic + prefix.length(), &field, 10);
+  if (index < 1 || index >= hpWorker.getUnitCount() || *field != '/')
+  {
+    return false;
+  }
+  field++;
+
+  String value = message;
+  value.toUpperCase();
+  HeatPump::Mode mode;
+  HeatPump::Fan fan;
+  HeatPump::Vane vane;
+  HeatPump::WideVane wideVane;
+  if (strcmp(field, "power/set") == 0 && (value == "ON" || value == "OFF"))
+  {
+    hpWorker.setPowerSetting(index, value == "ON" ? HeatPump::Power::On : HeatPump::Power::Off);
+  }
+  else if (strcmp(field, "mode/set") == 0 && value == "OFF")
+  {
+    hpWorker.setPowerSetting(index, HeatPump::Power::Off);
+  }
+  else if (strcmp(field, "mode/set") == 0)
+  {
+    if (value == "HEAT_COOL")
+      value = "AUTO";
+    else if (value == "FAN_ONLY")
+      value = "FAN";
+    if (!HeatPump::fromString(value.c_str(), mode))
     {
-      mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Failed to publish to heatpump/debug topic"));
+      return true;
     }
+    hpWorker.setPowerSetting(index, HeatPump::Power::On);
+    hpWorker.setModeSetting(index, mode);
   }
+  else if (strcmp(field, "temp/set") == 0)
+  {
+    float temperature = convertLocalUnitToCelsius(strtof(message, NULL), useFahrenheit);
+    if (temperature < min_temp || temperature > max_temp)
+    {
+      return true;
+    }
+    hpWorker.setTemperature(index, temperature);
+  }
+  else if (strcmp(field, "fan/set") == 0 && HeatPump::fromString(message, fan))
+  {
+    hpWorker.setFanSpeed(index, fan);
+  }
+  else if (strcmp(field, "vane/set") == 0 && HeatPump::fromString(message, vane))
+  {
+    hpWorker.setVaneSetting(index, vane);
+  }
+  else if (strcmp(field, "wideVane/set") == 0 && HeatPump::fromString(message, wideVane))
+  {
+    hpWorker.setWideVaneSetting(index, wideVane);
+  }
+  else
+  {
+    return true; // unknown field or value, nothing for unit 0 either
+  }
+  playBeep(SET);
+  return true;
 }
 
 // Used to send a dummy packet in state topic to validate action in HA interface
@@ -2050,6 +2630,7 @@ void hpSendLocalState()
     if (_debugMode)
       mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Failed to publish dummy hp status change"));
   }
+  statePublishPending = true; // the real state follows once the A/C reports it
 
   // Restart counter for waiting enought time for the unit to update before sending a state packet
   lastUpdate = millis();
@@ -2066,6 +2647,11 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
   }
   message[length] = '\0';
 
+  if (hpExtraUnitCallback(topic, message))
+  {
+    return;
+  }
+
   // HA topics
   // Receive power topic
   if (strcmp(topic, ha_power_set_topic.c_str()) == 0)
@@ -2075,14 +2661,14 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     if (modeUpper == "OFF")
     {
       playBeep(OFF);
-      hp.setPowerSetting("OFF");
+      hpWorker.setPowerSetting(0, HeatPump::Power::Off);
       hvacControl = true;
       previousCMDisPower = true;
     }
     else if (modeUpper == "ON")
     {
       playBeep(ON);
-      hp.setPowerSetting("ON");
+      hpWorker.setPowerSetting(0, HeatPump::Power::On);
       hvacControl = true;
       previousCMDisPower = true;
     }
@@ -2097,7 +2683,7 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
       rootInfo["mode"] = "off";
       rootInfo["action"] = "off";
       hpSendLocalState();
-      hp.setPowerSetting("OFF");
+      hpWorker.setPowerSetting(0, HeatPump::Power::Off);
       hvacControl = true;
     }
     else
@@ -2135,8 +2721,12 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
         return;
       }
       hpSendLocalState();
-      hp.setPowerSetting("ON");
-      hp.setModeSetting(modeUpper.c_str());
+      HeatPump::Mode mode;
+      hpWorker.setPowerSetting(0, HeatPump::Power::On);
+      if (HeatPump::fromString(modeUpper.c_str(), mode))
+      {
+        hpWorker.setModeSetting(0, mode);
+      }
       hvacControl = true;
       previousCMDisPower = true;
     }
@@ -2157,7 +2747,7 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     }
     playBeep(SET);
     hpSendLocalState();
-    hp.setTemperature(temperature_c);
+    hpWorker.setTemperature(0, temperature_c);
     hvacControl = true;
   }
   else if (strcmp(topic, ha_fan_set_topic.c_str()) == 0)
@@ -2165,7 +2755,11 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     rootInfo["fan"] = (String)message;
     playBeep(SET);
     hpSendLocalState();
-    hp.setFanSpeed(message);
+    HeatPump::Fan fan;
+    if (HeatPump::fromString(message, fan))
+    {
+      hpWorker.setFanSpeed(0, fan);
+    }
     hvacControl = true;
   }
   else if (strcmp(topic, ha_vane_set_topic.c_str()) == 0)
@@ -2173,7 +2767,11 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     rootInfo["vane"] = (String)message;
     playBeep(SET);
     hpSendLocalState();
-    hp.setVaneSetting(message);
+    HeatPump::Vane vane;
+    if (HeatPump::fromString(message, vane))
+    {
+      hpWorker.setVaneSetting(0, vane);
+    }
     hvacControl = true;
   }
   else if (strcmp(topic, ha_wideVane_set_topic.c_str()) == 0)
@@ -2181,26 +2779,31 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     rootInfo["wideVane"] = (String)message;
     playBeep(SET);
     hpSendLocalState();
-    hp.setWideVaneSetting(message);
+    HeatPump::WideVane wideVane;
+    if (HeatPump::fromString(message, wideVane))
+    {
+      hpWorker.setWideVaneSetting(0, wideVane);
+    }
     hvacControl = true;
   }
   else if (strcmp(topic, ha_remote_temp_set_topic.c_str()) == 0)
   {
+    // sensor data, no beep: a chatty sensor only updates the value hp sends, see REMOTE_TEMP_* in config.h
     float temperature = strtof(message, NULL);
-    playBeep(SET);
-    hp.setRemoteTemperature(convertLocalUnitToCelsius(temperature, useFahrenheit));
-    hvacControl = true;
+    hpWorker.streamRemoteTemperature(0, temperature > 0 ? convertLocalUnitToCelsius(temperature, useFahrenheit) : 0);
   }
   else if (strcmp(topic, ha_debug_set_topic.c_str()) == 0)
   { // if the incoming message is on the heatpump_debug_set_topic topic...
     if (strcmp(message, "on") == 0)
     {
       _debugMode = true;
+      hpWorker.setTraceEnabled(0, true);
       mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Debug mode enabled"));
     }
     else if (strcmp(message, "off") == 0)
     {
       _debugMode = false;
+      hpWorker.setTraceEnabled(0, false);
       mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Debug mode disabled"));
     }
   }
@@ -2226,11 +2829,32 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
     }
 
     // dump the packet so we can see what it is. handy because you can run the code without connecting the ESP to the heatpump, and test sending custom packets
-    hpPacketDebug(bytes, byteCount, "customPacket");
     playBeep(SET);
-    hp.sendCustomPacket(bytes, byteCount);
+    hpWorker.sendCustomPacket(0, bytes, byteCount);
     hvacControl = true;
   }
+  else if (strcmp(topic, ha_functions_set_topic.c_str()) == 0)
+  { // {"118": 2, ...} changes installer functions, only the changed half is written
+    StaticJsonDocument<512> doc;
+    if (deserializeJson(doc, message) == DeserializationError::Ok)
+    {
+      JsonObject codes = doc.as<JsonObject>();
+      heatpumpFunctions functions = hpWorker.getState(0).functions;
+      bool valid = functions.isValid() && codes.size() > 0;
+      for (JsonPair code : codes)
+      {
+        valid = valid && functions.setValue(atoi(code.key().c_str()), code.value().as<int>());
+      }
+      if (valid && hpWorker.setFunctions(0, functions))
+      {
+        playBeep(SET);
+      }
+      else if (_debugMode)
+      {
+        mqtt_client.publish(ha_debug_topic.c_str(), (char *)("Failed to set functions"));
+      }
+    }
+  }
   else if (strcmp(topic, ha_button_energy_set_topic.c_str()) == 0)
   {
     Log.ln(TAG, "Energy set");
@@ -2258,7 +2882,7 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
 
   if (hvacControl){
     lastCommandSend = millis();
-    hp.setInfoModeIndex(0);
+    hpWorker.setInfoModeIndex(0, HeatPump::RQST_PKT_SETTINGS);
   }
 
 }
@@ -2549,7 +3173,6 @@ void mqttConnect()
     {
       if (attempts == 5)
       {
-        lastMqttRetry = millis();
         return;
       }
       else
@@ -2575,6 +3198,11 @@ void mqttConnect()
       mqtt_client.subscribe(ha_wideVane_set_topic.c_str());
       mqtt_client.subscribe(ha_remote_temp_set_topic.c_str());
       mqtt_client.subscribe(ha_custom_packet.c_str());
+      mqtt_client.subscribe(ha_functions_set_topic.c_str());
+      for (int i = 1; i < hpWorker.getUnitCount(); i++)
+      {
+        mqtt_client.subscribe(hpUnitTopic(i, "+/set").c_str());
+      }
       mqtt_client.subscribe(ha_button_energy_set_topic.c_str());
       mqtt_client.subscribe(ha_switch_unit_led_set_topic.c_str());
       mqtt_client.subscribe(ha_switch_unit_beep_set_topic.c_str());
@@ -2584,6 +3212,9 @@ void mqttConnect()
         haConfig();
       }
       updateUnitSettings();
+      statePublishPending = true; // the state topic is not retained
+      publishedFunctionsSequence = 0;
+      memset(hpUnitPublished, 0, sizeof(hpUnitPublished));
     }
   }
 }
@@ -2773,16 +3404,17 @@ void handleButton()
 
     case (shortPress):
       Log.ln(TAG, "Handle Short press");
-      if (hp.isConnected())
+      if (hpWorker.getState(0).connected)
       {
+        const char *power = hpWorker.getState(0).settings.power;
         digitalWrite(LED_ACT, LED_ON);
-        if (hp.getPowerSetting() == "OFF")
+        if (power != nullptr && strcmp(power, "ON") == 0)
         {
-          hp.setPowerSetting("ON");
+          hpWorker.setPowerSetting(0, HeatPump::Power::Off);
         }
         else
         {
-          hp.setPowerSetting("OFF");
+          hpWorker.setPowerSetting(0, HeatPump::Power::On);
         }
         digitalWrite(LED_ACT, LED_OFF);
       }
@@ -2964,6 +3596,7 @@ void setup()
   loadOthers();
   loadUnit();
   loadEnergy();
+  loadCN105();
   if (initWifi())
   {
     if (SPIFFS.exists(console_file))
@@ -2982,6 +3615,7 @@ void setup()
     server.on("/others", handleOthers);
     server.on("/logging", handleLogging);
     server.on("/api/logs", handleAPILogs);
+    server.on("/api/functions", handleAPIFunctions);
     server.onNotFound(handleNotFound);
     if (login_password.length() > 0)
     {
@@ -2996,8 +3630,6 @@ void setup()
     server.on("/upload", HTTP_POST, handleUploadDone, handleUploadLoop);
 
     server.begin();
-    lastMqttRetry = 0;
-    lastHpSync = 0;
     hpConnectionRetries = 0;
     hpConnectionTotalRetries = 0;
     if (loadMqtt())
@@ -3016,6 +3648,9 @@ void setup()
       ha_state_topic = mqtt_topic + "/" + mqtt_fn + "/state";
       ha_debug_topic = mqtt_topic + "/" + mqtt_fn + "/debug";
       ha_debug_set_topic = mqtt_topic + "/" + mqtt_fn + "/debug/set";
+      ha_diagnostics_topic = mqtt_topic + "/" + mqtt_fn + "/diagnostics";
+      ha_functions_topic = mqtt_topic + "/" + mqtt_fn + "/functions";
+      ha_functions_set_topic = mqtt_topic + "/" + mqtt_fn + "/functions/set";
       ha_custom_packet = mqtt_topic + "/" + mqtt_fn + "/custom/send";
       ha_button_energy_set_topic = mqtt_topic + "/" + mqtt_fn + "/energy/set";
       ha_availability_topic = mqtt_topic + "/" + mqtt_fn + "/availability";
@@ -3042,22 +3677,28 @@ void setup()
       // write_log("Not found MQTT config go to configuration page");
     }
 
-    hp.setSettingsChangedCallback(hpSettingsChanged);
-    hp.setStatusChangedCallback(hpStatusChanged);
-    hp.setPacketCallback(hpPacketDebug);
+    hp.setTraceEnabled(_debugMode); // published by hpPublishTrace()
+    hp.setRemoteTemperatureTiming(REMOTE_TEMP_DEADBAND, REMOTE_TEMP_MIN_INTERVAL_MS, REMOTE_TEMP_REFRESH_MS, REMOTE_TEMP_TIMEOUT_MS);
+    hp.enableManualDispatch(); // the update results go through hpWorker, see hpUpdateResult()
     // Allow Remote/Panel
     // hp.enableExternalUpdate();
     hp.disableAutoUpdate();
-    if (hp.connect(acSerial))
-    {
-      Log.ln(TAG, "HVAC connected!");
-    }
-    else
-    {
-      Log.ln(TAG, "HVAC connection failed!");
-    }
-    heatpumpStatus currentStatus = hp.getStatus();
-    heatpumpSettings currentSettings = hp.getSettings();
+    hp.connect(acSerial); // the handshake completes in hpWorker
+    Log.ln(TAG, "HVAC connecting...");
+    hpManager.setAutoReconnect(hpManager.addUnit(&hp), false); // reconnected with the backoff in loop()
+    hpSetupExtraUnits();
+    // from here on the units are only reached through hpWorker
+    hpWorker.setUpdateResultCallback(hpUpdateResult);
+    if (hpWorker.begin(HP_TASK_CORE))
+    {
+      Log.ln(TAG, "HVAC task on core " + String(HP_TASK_CORE));
+    }
+#if CN105_BRIDGE_PORT > 0
+    bridgeServer.begin();
+    Log.ln(TAG, "CN105 bridge on port " + String(CN105_BRIDGE_PORT));
+#endif
+    heatpumpStatus currentStatus = hpWorker.getState(0).status;
+    heatpumpSettings currentSettings = hpWorker.getState(0).settings;
     rootInfo["roomTemperature"] = convertCelsiusToLocalUnit(currentStatus.roomTemperature, useFahrenheit);
     rootInfo["temperature"] = convertCelsiusToLocalUnit(currentSettings.temperature, useFahrenheit);
     rootInfo["fan"] = currentSettings.fan;
@@ -3086,117 +3727,220 @@ void setup()
   esp_task_wdt_init(30, true);
   esp_task_wdt_add(NULL);
 #endif
+  setupTasks();
 }
 
-void loop()
+// Periodic work, each task runs from loop() at the interval it is registered with in setupTasks().
+// Tasks must not block, the web server and MQTT are only serviced between them.
+
+// Web server, OTA, captive portal DNS and incoming MQTT messages
+void taskNetwork()
 {
-  bool mqttOK = false;
   server.handleClient();
   ArduinoOTA.handle();
-#ifdef ESP32
-  esp_task_wdt_reset();
-#endif
-
-  // reset board to attempt to connect to wifi again if in ap mode or wifi dropped out and time limit passed
-  if (WiFi.getMode() == WIFI_STA and WiFi.status() == WL_CONNECTED)
+  if (captive)
   {
-    wifi_timeout = millis() + WIFI_RETRY_INTERVAL_MS;
+    dnsServer.processNextRequest();
   }
-  else if (wifi_config_exists and millis() > wifi_timeout)
+  else if (mqtt_client.state() == MQTT_CONNECTED)
   {
-    ESP.restart();
+    mqtt_client.loop();
   }
+}
 
-  if (!captive)
+// CN105 side through hpWorker: runs it here unless it has a task of its own, takes what it published, then
+// follows the connection of unit 0 for the log, the backoff and cn105_file
+void taskHeatPump()
+{
+  hpWorker.loop(); // update results are handed to hpUpdateResult() from here
+  hpBridged = hpBridgeLoop();
+  if (hpBridged)
   {
+    return; // the CN105 line belongs to the bridge client until it disconnects
+  }
+  hpLogLink();
 
-    // Sync HVAC UNIT
-    if (!hp.isConnected())
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  if (state.connected != hpConnected || state.connecting != hpConnecting)
+  {
+    if (state.connected && !hpConnected)
     {
-      #ifdef ESP32
-      digitalWrite(LED_PWR, millis() / 1000 %2);
-      #endif
-      // Use exponential backoff for retries, where each retry is double the length of the previous one.
-      unsigned long timeNextSync = (1 << hpConnectionRetries) * HP_RETRY_INTERVAL_MS + lastHpSync;
-      if (((millis() > timeNextSync) or lastHpSync == 0))
+      Log.ln(TAG, "HVAC connected!");
+      if (state.preferredBitrate != hpBitrate)
       {
-        lastHpSync = millis();
-        // If we've retried more than the max number of tries, keep retrying at that fixed interval, which is several minutes.
-        hpConnectionRetries = min(hpConnectionRetries + 1u, HP_MAX_RETRIES);
-        hpConnectionTotalRetries++;
-        Log.ln(TAG, "HVAC is NOT connected, connecting...");
-        hp.sync();
-        if (hp.isConnected())
-        {
-          Log.ln(TAG, "HVAC connected!");
-        }
-        else
-        {
-          Log.ln(TAG, "HVAC connection failed!");
-        }
+        hpBitrate = state.preferredBitrate;
+        saveCN105();
       }
     }
-    else
+    else if (hpConnecting && !state.connected && !state.connecting)
     {
-      
-      #ifdef ESP32
-      digitalWrite(LED_PWR, ledEnabled? LED_ON: LED_OFF);
-      #endif
-      hpConnectionRetries = 0;
-
-        // Log.ln(TAG,"Sync");
-        hp.sync();
-        delay(1000);
-        // Log.ln(TAG,"Sync done");
-        // currentSettings = ac.getSettings();
-        // currentStatus = ac.getStatus();
-        // if (hp.isConnected()){
-        //   readHPstate(hp.getSettings(), hp.getStatus());
-        // }
-        // Log.ln(TAG, "PSRAM size:\t" + String(ESP.getPsramSize()));
-        // Log.ln(TAG, "PSRAM Free:\t" + String(ESP.getFreePsram()));
-        // Log.ln(TAG, "Heap left:\t" + String(esp_get_free_heap_size()));
-        // Log.ln(TAG, "Free Stack Space:\t" + String(uxTaskGetStackHighWaterMark(NULL)));
-    }
-
-    if (mqtt_config)
-    {
-      // MQTT failed retry to connect
-      if (mqtt_client.state() < MQTT_CONNECTED)
-      {
-        mqttOK = false;
-
-        if ((millis() - lastMqttRetry > MQTT_RETRY_INTERVAL_MS) or lastMqttRetry == 0)
-        {
-          mqttConnect();
-        }
-      }
-      // MQTT config problem on MQTT do nothing
-      else if (mqtt_client.state() > MQTT_CONNECTED)
-        return;
-      // MQTT connected send status
-      else
-      {
-        mqttOK = true;
-        hpStatusChanged(hp.getStatus());
-        mqtt_client.loop();
-      }
+      Log.ln(TAG, "HVAC connection failed!");
     }
+    hpConnected = state.connected;
+    hpConnecting = state.connecting;
+  }
+  if (!state.connected)
+  {
+    return;
+  }
+
+  if (hpConnectionRetries != 0)
+  {
+    hpConnectionRetries = 0;
+    scheduler.setInterval(hpReconnectTask, HP_RETRY_INTERVAL_MS);
+  }
+  if ((state.capabilities & HeatPump::CAP_PROBED) && state.capabilities != hpCapabilities)
+  {
+    hpCapabilities = state.capabilities;
+    Log.ln(TAG, "HVAC capabilities: 0x" + String(hpCapabilities, HEX));
+    saveCN105();
+  }
+}
+
+// Start the handshake again when the last one failed, with exponential backoff: each retry waits twice as long as
+// the previous one, up to HP_MAX_RETRIES doublings, then keeps retrying at that interval, which is several minutes.
+void taskHeatPumpReconnect()
+{
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  if (hpBridged || bridgePending || state.connected || state.connecting || state.detached)
+  {
+    return;
+  }
+  if (!hpWorker.connect(0))
+  {
+    return; // command queue full, try again at the next run
+  }
+  hpConnectionRetries = min(hpConnectionRetries + 1u, HP_MAX_RETRIES);
+  hpConnectionTotalRetries++;
+  Log.ln(TAG, "HVAC is NOT connected, connecting...");
+  scheduler.setInterval(hpReconnectTask, (1UL << hpConnectionRetries) * HP_RETRY_INTERVAL_MS);
+}
+
+void taskMqttReconnect()
+{
+  if (mqtt_config && mqtt_client.state() < MQTT_CONNECTED)
+  {
+    mqttConnect();
+  }
+}
+
+// State, functions, extra units and the packet trace; each only publishes what changed
+void taskMqttPublish()
+{
+  if (mqtt_client.state() != MQTT_CONNECTED)
+  {
+    return;
+  }
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  hpStatusChanged(state.status);
+  if (hpWorker.getChangedSince(0, publishedFunctionsSequence) & HeatPump::STATE_FUNCTIONS)
+  {
+    hpPublishFunctions();
+    publishedFunctionsSequence = state.stateSequence;
+  }
+  hpPublishExtraUnits();
+  hpPublishTrace();
+}
+
+void taskDiagnostics()
+{
+  if (mqtt_client.state() == MQTT_CONNECTED)
+  {
+    hpPublishDiagnostics();
+  }
+}
+
+// Read the installer functions again in the background once they are stale, hpPublishFunctions() follows.
+// After a request the next check waits FUNCTIONS_RETRY_INTERVAL_MS, in case the read fails.
+void taskFunctions()
+{
+  const HeatPumpWorker::State &state = hpWorker.getState(0);
+  if (state.connected && (state.capabilities & HeatPump::CAP_FUNCTIONS) && !state.probing && !state.fetchingFunctions &&
+      hpFunctionsStale() && hpWorker.requestFunctions(0))
+  {
+    scheduler.setInterval(hpFunctionsTask, FUNCTIONS_RETRY_INTERVAL_MS);
   }
   else
   {
-    dnsServer.processNextRequest();
-    digitalWrite(LED_ACT, LED_ON);
+    scheduler.setInterval(hpFunctionsTask, FUNCTIONS_TASK_MS);
   }
+}
 
-  //Handle ACT LED
-  if (hp.sendPending() || !mqttOK ){
-    digitalWrite(LED_ACT,LED_ON);
-  }else{
-    digitalWrite(LED_ACT,LED_OFF);
+void taskCN105Save()
+{
+  const HeatPumpWorker::Details &details = hpWorker.getDetails();
+  if (details.takenAt != 0 && hpWorker.getState(0).connected && memcmp(&details.timing, &hpTiming, sizeof(hpTiming)) != 0)
+  {
+    saveCN105();
   }
+}
 
+void taskEnergySave()
+{
+  if (energy - lastEnergySavedValue > ENERGY_SAVE_THRESHOLD)
+  {
+    Log.ln(TAG, "Save energy to SPIFFS");
+    saveEnergy(energy);
+    lastEnergySavedValue = energy;
+  }
+}
+
+// ACT LED on while a change is waiting to be sent or MQTT is down, PWR LED blinks while the A/C is not connected
+void taskLeds()
+{
+  bool mqttOK = !captive && mqtt_config && mqtt_client.state() == MQTT_CONNECTED;
+  digitalWrite(LED_ACT, (hpWorker.getState(0).sendPending || !mqttOK) ? LED_ON : LED_OFF);
 #ifdef ESP32
+  if (!captive && !hpBridged)
+  {
+    digitalWrite(LED_PWR, hpWorker.getState(0).connected ? (ledEnabled ? LED_ON : LED_OFF) : millis() / 1000 % 2);
+  }
   handleButton();
 #endif
 }
+
+// Watchdog feed, and a restart when WiFi stays lost longer than WIFI_RETRY_INTERVAL_MS
+void taskWatchdog()
+{
+#ifdef ESP32
+  esp_task_wdt_reset();
+#endif
+  if (WiFi.getMode() == WIFI_STA and WiFi.status() == WL_CONNECTED)
+  {
+    wifi_timeout = millis() + WIFI_RETRY_INTERVAL_MS;
+  }
+  else if (wifi_config_exists and millis() > wifi_timeout)
+  {
+    ESP.restart();
+  }
+}
+
+void setupTasks()
+{
+  scheduler.begin();
+  scheduler.add(taskNetwork, NETWORK_TASK_MS);
+  scheduler.add(taskLeds, LED_TASK_MS);
+  scheduler.add(taskWatchdog, WATCHDOG_TASK_MS);
+  if (captive)
+  {
+    return;
+  }
+  scheduler.add(taskHeatPump, HP_TASK_MS);
+  hpReconnectTask = scheduler.add(taskHeatPumpReconnect, HP_RETRY_INTERVAL_MS);
+  scheduler.add(taskMqttReconnect, MQTT_RETRY_INTERVAL_MS);
+  scheduler.add(taskMqttPublish, PUBLISH_TASK_MS);
+  scheduler.add(taskDiagnostics, DIAGNOSTICS_INTERVAL_MS, DIAGNOSTICS_INTERVAL_MS);
+  hpFunctionsTask = scheduler.add(taskFunctions, FUNCTIONS_TASK_MS);
+  scheduler.add(taskCN105Save, CN105_SAVE_INTERVAL * 60000UL, CN105_SAVE_INTERVAL * 60000UL);
+  scheduler.add(taskEnergySave, ENERGY_SAVE_INTERVAL * 60000UL, ENERGY_SAVE_INTERVAL * 60000UL);
+}
+
+void loop()
+{
+  // sleep until the next task is due, delay() lets the WiFi stack run meanwhile
+  unsigned long idle = scheduler.run();
+  if (idle > 0)
+  {
+    delay(idle);
+  }
+}
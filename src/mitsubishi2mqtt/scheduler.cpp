@@ -0,0 +1,93 @@
+#include "scheduler.h"
+
+void Scheduler::begin()
+{
+  memset(slots, -1, sizeof(slots));
+  taskCount = 0;
+  lastTick = millis();
+}
+
+int Scheduler::add(TaskFunction function, unsigned long intervalMs, unsigned long firstDelayMs)
+{
+  if (taskCount >= MAX_TASKS)
+  {
+    return -1;
+  }
+  int task = taskCount++;
+  tasks[task].function = function;
+  tasks[task].intervalMs = intervalMs;
+  tasks[task].due = millis() + firstDelayMs;
+  insert(task);
+  return task;
+}
+
+void Scheduler::setInterval(int task, unsigned long intervalMs)
+{
+  if (task >= 0 && task < taskCount)
+  {
+    tasks[task].intervalMs = intervalMs;
+  }
+}
+
+unsigned long Scheduler::run()
+{
+  unsigned long now = millis();
+  // one slot per elapsed millisecond; after a long stall one turn of the wheel visits every task
+  unsigned long ticks = now - lastTick;
+  if (ticks > (unsigned long)WHEEL_SLOTS)
+  {
+    ticks = WHEEL_SLOTS;
+  }
+  for (unsigned long tick = now - ticks + 1; tick != now + 1; tick++)
+  {
+    lastTick = tick;
+    int slot = tick % WHEEL_SLOTS;
+    int8_t task = slots[slot];
+    slots[slot] = -1; // detached, the tasks of this slot are inserted again as they run
+    while (task >= 0)
+    {
+      int8_t next = tasks[task].next;
+      if ((long)(now - tasks[task].due) >= 0)
+      {
+        tasks[task].function();
+        // keep the cadence, but a task that fell behind does not catch up in a burst
+        tasks[task].due += tasks[task].intervalMs;
+        if ((long)(millis() - tasks[task].due) >= 0)
+        {
+          tasks[task].due = millis() + tasks[task].intervalMs;
+        }
+      }
+      insert(task);
+      task = next;
+    }
+  }
+
+  now = millis();
+  unsigned long idle = WHEEL_SLOTS;
+  for (int task = 0; task < taskCount; task++)
+  {
+    long left = (long)(tasks[task].due - now);
+    if (left <= 0)
+    {
+      return 0;
+    }
+    if ((unsigned long)left < idle)
+    {
+      idle = left;
+    }
+  }
+  return idle;
+}
+
+// A task whose slot has already been run for this turn goes into the next one, the due time decides when it runs.
+void Scheduler::insert(int task)
+{
+  unsigned long tick = tasks[task].due;
+  if ((long)(tick - lastTick) <= 0)
+  {
+    tick = lastTick + 1;
+  }
+  int slot = tick % WHEEL_SLOTS;
+  tasks[task].next = slots[slot];
+  slots[slot] = task;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Cooperative scheduler for the periodic work of the sketch. Every task is a plain function with an interval;
+// loop() calls run() and sleeps until the next task is due instead of waiting a fixed time.
+// Tasks are kept in a timer wheel of WHEEL_SLOTS one-millisecond slots, so a tick only looks at the tasks of its
+// own slot; a task due later than one turn of the wheel stays in its slot until its time has come.
+class Scheduler
+{
+  public:
+    typedef void (*TaskFunction)();
+    static const int MAX_TASKS = 16;
+    static const int WHEEL_SLOTS = 64;
+
+    void begin();
+    int add(TaskFunction function, unsigned long intervalMs, unsigned long firstDelayMs = 0); // task id, -1 if full
+    void setInterval(int task, unsigned long intervalMs); // from the next run on, e.g. a backoff
+    unsigned long run();  // run the due tasks, returns the ms until the next one is due
+
+  private:
+    struct Task
+    {
+      TaskFunction function;
+      unsigned long intervalMs;
+      unsigned long due;
+      int8_t next; // next task in the same slot, -1 at the end
+    };
+
+    Task tasks[MAX_TASKS];
+    int taskCount = 0;
+    int8_t slots[WHEEL_SLOTS];
+    unsigned long lastTick = 0; // last millis() whose slot has been run
+
+    void insert(int task);
+};